@@ -0,0 +1,174 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "agg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+struct agg *agg_new(size_t slots)
+{
+	struct agg *a;
+	size_t n = 16;
+
+	while (n < slots) {
+		n <<= 1;
+	}
+
+	a = calloc(1, sizeof(struct agg));
+	if (!a) {
+		return NULL;
+	}
+	a->entries = calloc(n, sizeof(struct agg_entry));
+	a->taken   = calloc(n, sizeof(struct agg_entry));
+	if (!a->entries || !a->taken) {
+		agg_free(a);
+		return NULL;
+	}
+	a->slots = n;
+	a->mask  = n - 1;
+	a->limit = n * AGG_LOAD_PCT / 100;
+	return a;
+}
+
+
+void agg_free(struct agg *a)
+{
+	if (!a) {
+		return;
+	}
+	free(a->entries);
+	free(a->taken);
+	free(a);
+}
+
+
+/* fnv-1a over key and field */
+static uint64_t agg_hash(const char *key, const char *field)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *key; key++) {
+		h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+	}
+	h = (h ^ 0xff) * 1099511628211ULL;
+	for (; *field; field++) {
+		h = (h ^ (unsigned char)*field) * 1099511628211ULL;
+	}
+	return h;
+}
+
+
+/*
+ * count is folded as a sum of value. A put back last value is older
+ * than one added since the take, it only fills an empty pair
+ */
+static int agg_fold(struct agg *a, const char *key, const char *field, int func,
+		long long value, int back)
+{
+	uint64_t h = agg_hash(key, field);
+	size_t i = h & a->mask;
+	struct agg_entry *e;
+
+	/* linear probing, nothing is deleted but by agg_take() */
+	for (;; i = (i + 1) & a->mask) {
+		e = &a->entries[i];
+		if (!e->used) {
+			break;
+		}
+		if (e->hash == h && strcmp(e->key, key) == 0 && strcmp(e->field, field) == 0) {
+			switch (e->func) {
+				case AGG_SUM:
+				case AGG_COUNT: e->value += value; break;
+				case AGG_MIN:   if (value < e->value) e->value = value; break;
+				case AGG_MAX:   if (value > e->value) e->value = value; break;
+				default:        if (!back) e->value = value; break;
+			}
+			return 0;
+		}
+	}
+
+	if (a->used >= a->limit) {
+		return -1;
+	}
+	e->used  = 1;
+	e->err   = 0;
+	e->hash  = h;
+	e->func  = func;
+	e->value = value;
+	strncpy(e->key, key, AGG_KEY_LEN - 1);
+	e->key[AGG_KEY_LEN - 1] = '\0';
+	strncpy(e->field, field, AGG_FIELD_LEN - 1);
+	e->field[AGG_FIELD_LEN - 1] = '\0';
+	a->used++;
+	return 0;
+}
+
+
+int agg_add(struct agg *a, const char *key, const char *field, int func, long long value)
+{
+	return agg_fold(a, key, field, func, func == AGG_COUNT ? 1 : value, 0);
+}
+
+
+int agg_put_back(struct agg *a, const struct agg_entry *e)
+{
+	return agg_fold(a, e->key, e->field, e->func, e->value, 1);
+}
+
+
+struct agg_entry *agg_take(struct agg *a, size_t *n)
+{
+	size_t i, k = 0;
+
+	for (i = 0; i < a->slots && k < a->used; i++) {
+		if (a->entries[i].used) {
+			a->taken[k++] = a->entries[i];
+			a->entries[i].used = 0;
+		}
+	}
+	a->used = 0;
+	*n = k;
+	return a->taken;
+}
+
+
+int agg_func_parse(const char *name)
+{
+	static const char *names[] = {"sum", "count", "min", "max", "last"};
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,101 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __AGG_H__
+#define __AGG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * per-worker aggregation of (key, field) values over a window: an
+ * open-addressing table, flushed with agg_take() and re-filled by the
+ * worker that owns it, so no locking
+ */
+#define AGG_SUM    0
+#define AGG_COUNT  1   /* events, the value is ignored */
+#define AGG_MIN    2
+#define AGG_MAX    3
+#define AGG_LAST   4
+
+#define AGG_KEY_LEN    32
+#define AGG_FIELD_LEN  32
+
+/* agg_add() fails above this share of the slots, in percent */
+#define AGG_LOAD_PCT   75
+
+struct agg_entry {
+	char key[AGG_KEY_LEN];
+	char field[AGG_FIELD_LEN];
+	int func;               /* AGG_* */
+	int used;
+	int err;                /* set by a flush that failed this entry */
+	long long value;
+	uint64_t hash;
+};
+
+struct agg {
+	size_t slots;           /* power of 2 */
+	size_t mask;
+	size_t used;
+	size_t limit;           /* of used */
+	struct agg_entry *entries;
+	struct agg_entry *taken; /* what agg_take() hands out */
+};
+
+/* slots rounded up to a power of 2 */
+struct agg *agg_new(size_t slots);
+void agg_free(struct agg *a);
+
+/* 1 if n more (key, field) pairs may not fit */
+static inline int agg_full(const struct agg *a, size_t n)
+{
+	return a->used + n > a->limit;
+}
+
+/**
+ * fold value into (key, field) by func: a pair keeps the func it was
+ * first added with
+ * @return 0, -1 if the table is full
+ */
+int agg_add(struct agg *a, const char *key, const char *field, int func, long long value);
+
+/* an entry of agg_take() again, one a flush failed; a last value added since wins */
+int agg_put_back(struct agg *a, const struct agg_entry *e);
+
+/**
+ * empty the table
+ * @return its entries, *n of them, valid until the next agg_take()
+ */
+struct agg_entry *agg_take(struct agg *a, size_t *n);
+
+/* "sum", "count", "min", "max" or "last", -1 if none */
+int agg_func_parse(const char *name);
+
+#endif
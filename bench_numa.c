@@ -0,0 +1,165 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bench_numa: what a pool on the wrong numa node costs
+ *
+ * A producer pushes trk_items into a pool, a consumer pinned to a cpu
+ * of node 0 pops them. The pool is allocated (first touched) by a thread
+ * pinned to node 0 or to node 1, the producer runs on node 0 or node 1:
+ *
+ *   local        pool, producer and consumer on node 0
+ *   remote pool  pool on node 1, what trk_thread_init used to do
+ *   remote push  producer on node 1, like a listener on the other socket
+ *
+ * With hugepages as argument the pools use POOL_HUGEPAGES.
+ *
+ * Usage: ./bench_numa [items] [hugepages]
+ */
+
+#include "pool.h"
+#include "thread.h"
+#include "topology.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+struct bench {
+  struct pool *pool;
+  long items;
+  int cpu;               /* of the thread */
+  size_t bytes;          /* to allocate */
+  int flags;
+};
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *allocator(void *arg)
+{
+  struct bench *b = arg;
+  topology_pin_cpu(b->cpu);
+  b->pool = pool_new(b->bytes, TRK_POOL_CELL, b->flags);
+  return NULL;
+}
+
+static void *producer(void *arg)
+{
+  struct bench *b = arg;
+  struct trk_item item;
+  long i;
+
+  topology_pin_cpu(b->cpu);
+  memset(&item, 0, sizeof(item));
+  snprintf(item.query_str, sizeof(item.query_str),
+      "t=1386057600&op=1&trk_id=12345678&data=42&date=20131203&salt=%040d", 0);
+  for (i = 0; i < b->items; i++) {
+    item.trk_id = i;
+    while (pool_push(b->pool, &item, trk_item_len(&item)) != 0) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+static double run(int alloc_cpu, int push_cpu, int pop_cpu, long items, int flags)
+{
+  struct bench a, p;
+  struct trk_item batch[TRK_DRAIN_BATCH];
+  pthread_t thread;
+  long popped = 0;
+
+  /* big enough to miss the caches */
+  a.cpu   = alloc_cpu;
+  a.bytes = 64 << 20;
+  a.flags = flags;
+  pthread_create(&thread, NULL, allocator, &a);
+  pthread_join(thread, NULL);
+  if (!a.pool) {
+    fprintf(stderr, "pool_new failure\n");
+    exit(1);
+  }
+
+  topology_pin_cpu(pop_cpu);
+  p = a;
+  p.cpu   = push_cpu;
+  p.items = items;
+
+  double begin = now();
+  pthread_create(&thread, NULL, producer, &p);
+  while (popped < items) {
+    size_t n = pool_pop_batch(a.pool, batch, sizeof(struct trk_item), TRK_DRAIN_BATCH);
+    if (n == 0) sched_yield();
+    popped += n;
+  }
+  double cost = now() - begin;
+  pthread_join(thread, NULL);
+
+  pool_free(a.pool);
+  return items / cost;
+}
+
+int main(int argc, char *argv[])
+{
+  long items = argc > 1 ? atol(argv[1]) : 2000000;
+  int flags  = argc > 2 && strcmp(argv[2], "hugepages") == 0 ? POOL_HUGEPAGES : 0;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int cpu, near = -1, near2 = -1, far = -1;
+
+  /* two cpus of node 0, one of another node */
+  for (cpu = 0; cpu < ncpus; cpu++) {
+    int node = topology_cpu_node(cpu);
+    if (node <= 0) {
+      if (near < 0) near = cpu; else if (near2 < 0) near2 = cpu;
+    } else if (far < 0) {
+      far = cpu;
+    }
+  }
+  if (near2 < 0) near2 = near;
+  if (far < 0) {
+    printf("single numa node, remote cases run on node 0\n");
+    far = near2;
+  }
+
+  printf("cpus: consumer %d, local producer %d, remote %d\n", near, near2, far);
+  printf("%12s %14s\n", "case", "ops/s");
+  printf("%12s %14.0f\n", "local",       run(near, near2, near, items, flags));
+  printf("%12s %14.0f\n", "remote pool", run(far,  near2, near, items, flags));
+  printf("%12s %14.0f\n", "remote push", run(near, far,   near, items, flags));
+  return 0;
+}
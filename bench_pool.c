@@ -0,0 +1,212 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bench_pool: lock free pool vs the old mutex pool
+ *
+ * N producers push trk_items with a typical query string into one pool,
+ * one consumer pops them, like the listeners and a worker do.
+ * The old pool copies the whole item, the ring only its used bytes.
+ *
+ * Usage: ./bench_pool [items per producer]
+ */
+
+#include "pool.h"
+#include "thread.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+   -------------------------------------------------------------------------------
+   the old pool: pthread_mutex_trylock on push, one shared cache line
+   -------------------------------------------------------------------------------
+   */
+struct legacy_pool {
+  size_t element_size;
+  size_t capacity;
+  void *data;
+  void *head;
+  void *tail;
+  pthread_mutex_t insert_lock;
+};
+
+static inline void *legacy_next_ele(struct legacy_pool *p, void *ptr)
+{
+  if (ptr == p->data + p->element_size*(p->capacity - 1)) {
+    return p->data;
+  }
+  return ptr + p->element_size;
+}
+
+static struct legacy_pool *legacy_pool_new(size_t capacity, size_t element_size)
+{
+  struct legacy_pool *p = calloc(1, sizeof(struct legacy_pool));
+  p->data = calloc(capacity, element_size);
+  p->capacity     = capacity;
+  p->element_size = element_size;
+  p->tail = p->data;
+  p->head = p->data + p->element_size;
+  pthread_mutex_init(&p->insert_lock, NULL);
+  return p;
+}
+
+static int legacy_pool_push(struct legacy_pool *p, void *ele)
+{
+  if (pthread_mutex_trylock(&p->insert_lock) != 0) {
+    return -1;
+  }
+  void *next_head = legacy_next_ele(p, p->head);
+  if (next_head == p->tail) {
+    pthread_mutex_unlock(&p->insert_lock);
+    return -2;
+  }
+  memcpy(p->head, ele, p->element_size);
+  p->head = next_head;
+  pthread_mutex_unlock(&p->insert_lock);
+  return 0;
+}
+
+static int legacy_pool_pop(struct legacy_pool *p, void *ele)
+{
+  void *next_tail = legacy_next_ele(p, p->tail);
+  if (next_tail == p->head) {
+    return -1;
+  }
+  p->tail = next_tail;
+  memcpy(ele, p->tail, p->element_size);
+  return 0;
+}
+
+
+/*
+   -------------------------------------------------------------------------------
+   bench
+   -------------------------------------------------------------------------------
+   */
+struct bench {
+  int legacy;
+  void *pool;
+  long items;             /* per producer */
+  volatile int start;
+};
+
+static void *producer(void *arg)
+{
+  struct bench *b = arg;
+  struct trk_item item;
+  long i;
+  int res;
+
+  memset(&item, 0, sizeof(item));
+  snprintf(item.query_str, sizeof(item.query_str),
+      "t=1386057600&op=1&trk_id=12345678&data=42&date=20131203&salt=%040d", 0);
+  while (!b->start) { sched_yield(); }
+
+  for (i = 0; i < b->items; i++) {
+    item.trk_id = i;
+    if (b->legacy) {
+      /* what push_ele_to_pool used to do */
+      while ((res = legacy_pool_push(b->pool, &item)) != 0) {
+        if (res == -1) usleep(1); else sched_yield();
+      }
+    } else {
+      while (pool_push(b->pool, &item, trk_item_len(&item)) != 0) {
+        sched_yield();
+      }
+    }
+  }
+  return NULL;
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double run(int legacy, int nproducers, long items)
+{
+  struct bench b;
+  pthread_t threads[64];
+  struct trk_item item;
+  long total = items * nproducers, popped = 0;
+  int i;
+
+  b.legacy = legacy;
+  b.items  = items;
+  b.start  = 0;
+  b.pool   = legacy ? (void *)legacy_pool_new(16384, sizeof(struct trk_item))
+                    : (void *)pool_new(16384 * sizeof(struct trk_item), TRK_POOL_CELL, 0);
+
+  for (i = 0; i < nproducers; i++) {
+    pthread_create(&threads[i], NULL, producer, &b);
+  }
+
+  double begin = now();
+  b.start = 1;
+  while (popped < total) {
+    int res = legacy ? legacy_pool_pop(b.pool, &item) : (pool_pop(b.pool, &item, sizeof(item)) < 0);
+    if (res == 0) popped++; else sched_yield();
+  }
+  double cost = now() - begin;
+
+  for (i = 0; i < nproducers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  if (legacy) {
+    struct legacy_pool *p = b.pool;
+    free(p->data);
+    free(p);
+  } else {
+    pool_free(b.pool);
+  }
+  return total / cost;
+}
+
+int main(int argc, char *argv[])
+{
+  long items = argc > 1 ? atol(argv[1]) : 100000;
+  int n;
+
+  printf("%9s %14s %14s\n", "producers", "mutex ops/s", "lockfree ops/s");
+  for (n = 1; n <= 64; n *= 2) {
+    double legacy = run(1, n, items);
+    double ring   = run(0, n, items);
+    printf("%9d %14.0f %14.0f\n", n, legacy, ring);
+  }
+  return 0;
+}
@@ -0,0 +1,188 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bench_resp: the sinks' redis commands by resp.h vs hiredis
+ *
+ *   encode  HINCRBY ddtrack_<id> <field> <data>, what ddtrack writes per
+ *           rollup bucket: redisFormatCommand parses the format and
+ *           allocates every command, resp_* append to one reused buffer
+ *   parse   ":<n>\r\n" replies: a redisReader allocates a redisReply
+ *           per reply, resp_parse reads them in place
+ *
+ * Usage: ./bench_resp [commands]
+ */
+
+#include "resp.h"
+
+#include <hiredis/hiredis.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* bytes of the commands, so neither side is optimized away */
+static size_t encode_hiredis(long n)
+{
+  char key[32], field[32];
+  size_t bytes = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    char *cmd;
+    int len;
+    snprintf(key, sizeof(key), "ddtrack_%ld", i & 1023);
+    snprintf(field, sizeof(field), "2013120312%04ld", i % 10000);
+    len = redisFormatCommand(&cmd, "HINCRBY %s %s %lld", key, field, (long long)i);
+    bytes += len;
+    free(cmd);
+  }
+  return bytes;
+}
+
+static size_t encode_resp(long n)
+{
+  struct resp_buf b = {0};
+  char key[32], field[32];
+  size_t bytes = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(key, sizeof(key), "ddtrack_%ld", i & 1023);
+    snprintf(field, sizeof(field), "2013120312%04ld", i % 10000);
+    /* a batch per TRK_DRAIN_BATCH-ish commands, like redis_pipeline */
+    if ((i & 255) == 0) {
+      bytes += b.len;
+      resp_buf_reset(&b);
+    }
+    resp_begin(&b, 4);
+    resp_arg(&b, "HINCRBY", 7);
+    resp_arg_str(&b, key);
+    resp_arg_str(&b, field);
+    resp_arg_ll(&b, i);
+  }
+  bytes += b.len;
+  resp_buf_free(&b);
+  return bytes;
+}
+
+/* n integer replies, one after the other */
+static char *replies(long n, size_t *len)
+{
+  char *buf = malloc(n * 24), *p = buf;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    p += sprintf(p, ":%ld\r\n", i);
+  }
+  *len = p - buf;
+  return buf;
+}
+
+static long long parse_hiredis(const char *buf, size_t len, long n)
+{
+  redisReader *r = redisReaderCreate();
+  long long sum = 0;
+  long i;
+
+  redisReaderFeed(r, buf, len);
+  for (i = 0; i < n; i++) {
+    redisReply *reply;
+    if (redisReaderGetReply(r, (void **)&reply) != REDIS_OK || reply == NULL) {
+      break;
+    }
+    sum += reply->integer;
+    freeReplyObject(reply);
+  }
+  redisReaderFree(r);
+  return sum;
+}
+
+static long long parse_resp(const char *buf, size_t len, long n)
+{
+  struct resp_reply reply;
+  long long sum = 0;
+  size_t pos = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    int used = resp_parse(buf + pos, len - pos, &reply);
+    if (used <= 0) {
+      break;
+    }
+    pos += used;
+    sum += reply.integer;
+  }
+  return sum;
+}
+
+int main(int argc, char *argv[])
+{
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t len, b1, b2;
+  long long s1, s2;
+  double t;
+  char *buf;
+
+  t = now();
+  b1 = encode_hiredis(n);
+  double enc_hiredis = n / (now() - t);
+  t = now();
+  b2 = encode_resp(n);
+  double enc_resp = n / (now() - t);
+  if (b1 != b2) {
+    fprintf(stderr, "encoded %zu bytes vs %zu\n", b1, b2);
+    return 1;
+  }
+
+  buf = replies(n, &len);
+  t = now();
+  s1 = parse_hiredis(buf, len, n);
+  double parse_h = n / (now() - t);
+  t = now();
+  s2 = parse_resp(buf, len, n);
+  double parse_r = n / (now() - t);
+  free(buf);
+  if (s1 != s2) {
+    fprintf(stderr, "parsed %lld vs %lld\n", s1, s2);
+    return 1;
+  }
+
+  printf("%8s %14s %14s\n", "", "hiredis ops/s", "resp ops/s");
+  printf("%8s %14.0f %14.0f\n", "encode", enc_hiredis, enc_resp);
+  printf("%8s %14.0f %14.0f\n", "parse", parse_h, parse_r);
+  return 0;
+}
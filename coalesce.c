@@ -0,0 +1,145 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "coalesce.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+struct coalesce *coalesce_new(size_t max, const char *by)
+{
+	struct coalesce *c;
+	size_t n = 16;
+
+	while (n < max * 2) {
+		n <<= 1;
+	}
+
+	c = calloc(1, sizeof(struct coalesce));
+	if (!c) {
+		return NULL;
+	}
+	c->hashes = calloc(n, sizeof(uint64_t));
+	c->idx    = calloc(n, sizeof(uint32_t));
+	c->items  = calloc(max, sizeof(struct trk_item));
+	if (!c->hashes || !c->idx || !c->items) {
+		coalesce_free(c);
+		return NULL;
+	}
+	c->slots = n;
+	c->mask  = n - 1;
+	c->max   = max;
+	snprintf(c->by, sizeof(c->by), "%s=", by);
+	return c;
+}
+
+
+void coalesce_free(struct coalesce *c)
+{
+	if (!c) {
+		return;
+	}
+	free(c->hashes);
+	free(c->idx);
+	free(c->items);
+	free(c);
+}
+
+
+/* the value of c->by in item's query string, *len bytes of it */
+static const char *coalesce_arg(const struct coalesce *c, const struct trk_item *item, size_t *len)
+{
+	size_t blen = strlen(c->by);
+	const char *p = item->query_str;
+
+	while (p) {
+		if (strncmp(p, c->by, blen) == 0) {
+			p += blen;
+			*len = strcspn(p, "&");
+			return p;
+		}
+		p = strchr(p, '&');
+		if (p) {
+			p++;
+		}
+	}
+	*len = 0;
+	return "";
+}
+
+
+int coalesce_put(struct coalesce *c, const struct trk_item *item)
+{
+	size_t len, olen;
+	const char *arg = coalesce_arg(c, item, &len);
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	/* fnv-1a over trk_id and the arg, 0 marks an empty slot */
+	for (i = 0; i < sizeof(item->trk_id); i++) {
+		h = (h ^ ((item->trk_id >> (i * 8)) & 0xff)) * 1099511628211ULL;
+	}
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)arg[i]) * 1099511628211ULL;
+	}
+	h |= 1;
+
+	for (i = h & c->mask; c->hashes[i]; i = (i + 1) & c->mask) {
+		struct trk_item *old = &c->items[c->idx[i]];
+		const char *oarg;
+
+		if (c->hashes[i] != h || old->trk_id != item->trk_id) {
+			continue;
+		}
+		oarg = coalesce_arg(c, old, &olen);
+		if (olen == len && memcmp(oarg, arg, len) == 0) {
+			memcpy(old, item, trk_item_len(item));
+			old->lsn = 0;  /* acked once buffered */
+			return c->used >= c->max;
+		}
+	}
+
+	if (c->used >= c->max) {
+		return -1;
+	}
+	c->hashes[i] = h;
+	c->idx[i]    = c->used;
+	memcpy(&c->items[c->used], item, trk_item_len(item));
+	c->items[c->used++].lsn = 0;  /* acked once buffered */
+	return c->used >= c->max;
+}
+
+
+void coalesce_clear(struct coalesce *c)
+{
+	memset(c->hashes, 0, c->slots * sizeof(uint64_t));
+	c->used = 0;
+}
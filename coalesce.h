@@ -0,0 +1,74 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COALESCE_H__
+#define __COALESCE_H__
+
+#include "trackd.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * last-write-wins buffer of trk items: an item replaces the buffered
+ * one of the same key, (trk_id, value of the query arg "by"). Items
+ * are kept dense in first-put order, so a flush is a plain array. Owned
+ * by one worker, no locking.
+ */
+struct coalesce {
+	size_t slots;             /* power of 2, twice max at least */
+	size_t mask;
+	size_t used;
+	size_t max;               /* items */
+	char by[16];              /* "date=" */
+	uint64_t *hashes;         /* of the slots, 0 if empty */
+	uint32_t *idx;            /* of the slots, in items */
+	struct trk_item *items;
+};
+
+/* max items, by is the query arg of the key */
+struct coalesce *coalesce_new(size_t max, const char *by);
+void coalesce_free(struct coalesce *c);
+
+/**
+ * buffer item, over the one of its key if any
+ * @return 0, 1 if the buffer is full now, -1 if it was full already
+ */
+int coalesce_put(struct coalesce *c, const struct trk_item *item);
+
+/* the buffered items, *n of them, until coalesce_clear() */
+static inline struct trk_item *coalesce_items(struct coalesce *c, size_t *n)
+{
+	*n = c->used;
+	return c->items;
+}
+
+void coalesce_clear(struct coalesce *c);
+
+#endif
@@ -297,18 +297,4 @@ void inifile_print(struct inifile *ini)
 	}
 }
 
-void get_token(int op,int trk_id,const char **token,struct settings **settings)
-{
-	if (op < 0 || op > DDTRACK_OP_MAX) return;
-
-	const struct token_item *p = (*settings)->op_funcs[op]->tokens;
-	while(p){
-		if (p->trk_id == trk_id){
-			*token = p->token;
-			break;
-		}
-		p = p->next;
-	}
-}
-
 
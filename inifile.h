@@ -110,6 +110,5 @@ struct iniitem *inifile_foreach_group(struct inifile *ini, const char *group,
 /* print all items */
 void inifile_print(struct inifile *ini);
 
-void get_token(int op,int trk_id,const char **token,struct settings **settings);
 
 #endif
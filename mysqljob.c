@@ -31,82 +31,277 @@
 #include "log.h"
 #include "thread.h"
 
+#include<assert.h>
 #include<time.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<mysql/errmsg.h>
 
-static int dashboard_job(MYSQL *conn,struct trk_item* trk_item);
+/* a server hanging up an idle client sends this before closing, 8.0.24+ */
+#ifndef ER_CLIENT_INTERACTION_TIMEOUT
+#define ER_CLIENT_INTERACTION_TIMEOUT 4031
+#endif
+
+/* the bound values of a row */
+struct dashboard_row {
+	unsigned long long trk_id;
+	int date;
+	int data;
+	char time[32];
+	unsigned long time_len;
+};
+
+static int dashboard_row(const struct trk_item *trk_item, struct dashboard_row *row);
+static int dashboard_exec(struct trk_client_node *node, struct func *f,
+		int slot, struct dashboard_row *rows);
+
+void *mysql_sink_connect(void* n){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	struct mysql_conn *conn = calloc(1, sizeof(struct mysql_conn));
+
+	if(conn == NULL){
+		return NULL;
+	}
+	conn->mysql = mysql_init(NULL);
+	if(conn->mysql == NULL){
+		free(conn);
+		return NULL;
+	}
+	/* a stuck server fails the node instead of the worker */
+	unsigned int timeout = node->timeout_ms / 1000;
+	if(timeout > 0){
+		mysql_options(conn->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+		mysql_options(conn->mysql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+		mysql_options(conn->mysql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+	}
+	if(!mysql_real_connect(conn->mysql,node->host,node->user,node->pass,node->db,
+				node->port,NULL,0)){
+		trackdLog(TRACKD_NOTICE,"connect mysql %s:%d error:(%d)%s",node->host,
+				(int)node->port,mysql_errno(conn->mysql),mysql_error(conn->mysql));
+		mysql_finalizer(conn);
+		return NULL;
+	}
+	return conn;
+}
 
 int mysql_proc(void* n,void* item){
+	int ret;
+
 	if (n == NULL || item == NULL) {
 		return TRACKD_ERR;
 	}
 
+	mysql_proc_batch(n, item, 1, &ret);
+	return ret;
+}
+
+/**
+ * the rows of the items by prepared multi-row REPLACEs, of 64, 32 .. 1
+ * rows so a batch takes a few round trips and commits. A statement the
+ * server refused goes again row by row, so only the rows it can't take
+ * fail; a lost connection fails what was not written yet and is
+ * dropped, next_client_node() connects again
+ */
+int mysql_proc_batch(void* n, void* items, size_t count, int* rets){
 	struct trk_client_node *node = (struct trk_client_node *)n;
-	struct trk_item *trk_item = (struct trk_item *)item;
+	struct trk_item *trk_items = (struct trk_item *)items;
+	struct func *f = op_func_get(g_settings, trk_items->op);
+	struct dashboard_row rows[TRK_DRAIN_BATCH];
+	size_t idx[TRK_DRAIN_BATCH];       /* of the rows, in items */
+	size_t nrows = 0, done, k, i, j;
+	int ret = TRACKD_OK, slot, r = 0;
+
+	assert(count <= TRK_DRAIN_BATCH);
 
-	switch(trk_item->op){
-		case 2:
-			//dashboard
-			return dashboard_job((MYSQL *)node->conn,trk_item);
-		default:
-			return TRACKD_OK;
-			//do nothing
+	for(i = 0; i < count; i++){
+		rets[i] = TRACKD_OK;
+		/* only dashboard goes to mysql, other ops are let through */
+		if(trk_items[i].op != 2){
+			continue;
+		}
+		if(dashboard_row(trk_items + i, rows + nrows) != TRACKD_OK){
+			trackdLog(TRACKD_NOTICE,"dashboard item of trk_id %llu has no valid date",
+					(unsigned long long)trk_items[i].trk_id);
+			continue;
+		}
+		idx[nrows++] = i;
 	}
 
-	return TRACKD_OK;
+	for(done = 0; done < nrows && r >= 0; done += k){
+		for(slot = MYSQL_STMT_SLOTS - 1; ((size_t)1 << slot) > nrows - done; slot--);
+		k = (size_t)1 << slot;
+
+		r = dashboard_exec(node, f, slot, rows + done);
+		for(j = done; r != 0 && j < done + k; j++){
+			int row_r = r;
+			if(r > 0 && k > 1){
+				row_r = dashboard_exec(node, f, 0, rows + j);
+			}
+			if(row_r != 0){
+				rets[idx[j]] = TRACKD_ERR;
+			}
+			if(row_r < 0){
+				r = -1;
+			}
+		}
+	}
+
+	/* connection lost, the rest is not written either */
+	for(j = done; j < nrows; j++){
+		rets[idx[j]] = TRACKD_ERR;
+	}
+	for(i = 0; i < count; i++){
+		if(rets[i] != TRACKD_OK){
+			ret = TRACKD_ERR;
+		}
+	}
+	return ret;
 }
 
 int mysql_finalizer(void* n){
-	if( n == NULL ){
+	struct mysql_conn *conn = (struct mysql_conn *)n;
+	int i;
+
+	if( conn == NULL ){
 		return TRACKD_OK;
 	}
 
-	mysql_close((MYSQL *)n);
+	for(i = 0; i < MYSQL_STMT_SLOTS; i++){
+		if(conn->stmts[i]){
+			mysql_stmt_close(conn->stmts[i]);
+		}
+	}
+	mysql_close(conn->mysql);
+	free(conn);
 
 	return TRACKD_OK;
 }
 
-static int dashboard_job(MYSQL *conn,struct trk_item* trk_item){
-	//check where the conn is alive
-	if(mysql_ping(conn) != 0){
-		return TRACKD_ERR;
-	}
-
+/* the values of an item, TRACKD_ERR if it has no valid date */
+static int dashboard_row(const struct trk_item *trk_item, struct dashboard_row *row){
 	const char *delimiter = "&";
 
-	int data = 0,date = 0;
 	time_t t;
-	char timestr[32];
+	struct tm local_time;
+
+	row->trk_id = trk_item->trk_id;
+	row->date = 0;
+	row->data = 0;
+	row->time[0] = '\0';
 
 	char *brkt;
 	char *str_cpy = strdup(trk_item->query_str);
 	char *pch = strtok_r(str_cpy, delimiter, &brkt);
 	while (pch != NULL) {
 		if (memcmp(pch, "data=", 5) == 0) {
-			data = atoi(pch+5);
+			row->data = atoi(pch+5);
 		} else if (memcmp(pch, "date=", 5) == 0){
-			date = atoi(pch+5);
+			row->date = atoi(pch+5);
 		} else if (memcmp(pch, "t=", 2) == 0) {
 			t = atoi(pch+2);
-			int n = strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&t));
-			timestr[n] = '\0';
+			localtime_r(&t, &local_time);
+			strftime(row->time, sizeof(row->time), "%Y-%m-%d %H:%M:%S", &local_time);
 		}
 		pch = strtok_r(NULL, delimiter, &brkt);
 	}
 	free(str_cpy);
+	row->time_len = strlen(row->time);
 
-	if (date < MIN_DATE){
-		return TRACKD_ERR;
+	return row->date < MIN_DATE ? TRACKD_ERR : TRACKD_OK;
+}
+
+/**
+ * the statement of 1 << slot rows of f's table, prepared on the
+ * connection the first time, NULL on failure with *err set
+ */
+static MYSQL_STMT *dashboard_stmt(struct mysql_conn *conn, struct func *f,
+		int slot, unsigned int *err){
+	char sql[MAX_SQL_LEN * 2];
+	MYSQL_STMT *stmt;
+	int len, i;
+
+	if(conn->stmts[slot]){
+		return conn->stmts[slot];
 	}
 
-	char sql[MAX_SQL_LEN];
-	snprintf(sql,sizeof(sql),"REPLACE INTO T_Zhixin_Stat values(NULL,%d,'%d',%d,'%s')",trk_item->trk_id,date,data,timestr);
-	if(mysql_query(conn,sql) != 0){
-		trackdLog(TRACKD_NOTICE,"replace into mysql error:(%d)%s",mysql_errno(conn),mysql_error(conn));
-		return TRACKD_ERR;
+	//REPLACE INTO T_Zhixin_Stat values(NULL,?,?,?,?),...
+	len = snprintf(sql, sizeof(sql), "REPLACE INTO %s%s%s%s values", f->mysql_table,
+			f->mysql_columns ? "(" : "", f->mysql_columns ? f->mysql_columns : "",
+			f->mysql_columns ? ")" : "");
+	for(i = 0; i < 1 << slot; i++){
+		len += snprintf(sql + len, sizeof(sql) - len, "%s%s", i ? "," : "",
+				f->mysql_columns ? "(?,?,?,?)" : "(NULL,?,?,?,?)");
 	}
 
-	return TRACKD_OK;
+	stmt = mysql_stmt_init(conn->mysql);
+	if(stmt == NULL){
+		*err = mysql_errno(conn->mysql);
+		return NULL;
+	}
+	if(mysql_stmt_prepare(stmt, sql, len) != 0){
+		*err = mysql_stmt_errno(stmt);
+		trackdLog(TRACKD_NOTICE,"prepare mysql statement error:(%d)%s",
+				*err,mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+	conn->stmts[slot] = stmt;
+	return stmt;
+}
+
+/**
+ * REPLACE 1 << slot rows
+ * @return 0, 1 if the server refused them, -1 if the connection was
+ * lost: it is closed and node->conn set NULL
+ */
+static int dashboard_exec(struct trk_client_node *node, struct func *f,
+		int slot, struct dashboard_row *rows){
+	struct mysql_conn *conn = (struct mysql_conn *)node->conn;
+	MYSQL_BIND binds[TRK_DRAIN_BATCH * 4];
+	MYSQL_STMT *stmt;
+	unsigned int err = 0;
+	int i;
+
+	if(conn == NULL){
+		return -1;
+	}
+
+	stmt = dashboard_stmt(conn, f, slot, &err);
+	if(stmt){
+		memset(binds, 0, sizeof(MYSQL_BIND) * 4 << slot);
+		for(i = 0; i < 1 << slot; i++){
+			MYSQL_BIND *b = binds + i * 4;
+			b[0].buffer_type = MYSQL_TYPE_LONGLONG;
+			b[0].buffer      = &rows[i].trk_id;
+			b[0].is_unsigned = 1;
+			b[1].buffer_type = MYSQL_TYPE_LONG;
+			b[1].buffer      = &rows[i].date;
+			b[2].buffer_type = MYSQL_TYPE_LONG;
+			b[2].buffer      = &rows[i].data;
+			b[3].buffer_type = MYSQL_TYPE_STRING;
+			b[3].buffer      = rows[i].time;
+			b[3].buffer_length = sizeof(rows[i].time);
+			b[3].length      = &rows[i].time_len;
+		}
+		if(mysql_stmt_bind_param(stmt, binds) == 0 && mysql_stmt_execute(stmt) == 0){
+			return 0;
+		}
+		err = mysql_stmt_errno(stmt);
+		trackdLog(TRACKD_NOTICE,"replace %d rows into mysql error:(%d)%s",
+				1 << slot,err,mysql_stmt_error(stmt));
+	}
+
+	/*
+	 * no ping per event, a lost connection shows up here: any error of
+	 * the client library (CR_*) leaves it unusable, a timed out read
+	 * included
+	 */
+	if((err >= CR_MIN_ERROR && err <= CR_MAX_ERROR) ||
+			err == ER_CLIENT_INTERACTION_TIMEOUT){
+		mysql_finalizer(conn);
+		node->conn = NULL;
+		return -1;
+	}
+	return 1;
 }
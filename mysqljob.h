@@ -31,11 +31,55 @@
 #define __MYSQLJOB_H__
 
 #include <mysql/mysql.h>
+#include <stddef.h>
+#include <string.h>
 
 #define MAX_COLUMN_LEN    32
 #define MAX_SQL_LEN    1024
 
+/* statements of 1, 2, 4 .. TRK_DRAIN_BATCH rows */
+#define MYSQL_STMT_SLOTS  7
+
+/*
+ * a mysql node's connection: the statements are prepared on first use
+ * and kept until it is lost, see mysql_proc_batch()
+ */
+struct mysql_conn {
+	MYSQL      *mysql;
+	MYSQL_STMT *stmts[MYSQL_STMT_SLOTS];  /* of 1 << i rows */
+};
+
+/**
+ * identifiers in a comma separated list, -1 if one is empty or has
+ * anything but [A-Za-z0-9_$] and '.' of a schema: they go into sql
+ */
+static inline int mysql_sql_names(const char *names)
+{
+	const char *p = names;
+	int n = 0;
+
+	while (1) {
+		size_t len = strspn(p, "abcdefghijklmnopqrstuvwxyz"
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_$.");
+		if (len == 0 || (p[len] != ',' && p[len] != '\0')) {
+			return -1;
+		}
+		n++;
+		p += len;
+		if (*p == '\0') {
+			return n;
+		}
+		p++;
+	}
+}
+
+/* a struct mysql_conn of node n, NULL if it can't connect */
+void *mysql_sink_connect(void* n);
+
 int mysql_proc(void* n,void* item);
+
+/* count <= TRK_DRAIN_BATCH items, rets[i] of each */
+int mysql_proc_batch(void* n, void* items, size_t count, int* rets);
 int mysql_finalizer(void* n);
 
 #endif
@@ -33,32 +33,133 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#define POOL_HUGEPAGE_SIZE (2UL << 20)
 
-static inline void *pool_next_ele(struct pool *p, void *ptr);
+/* record header, at the start of the first cell */
+struct pool_rec {
+  uint32_t len;
+  uint32_t cells;
+};
 
+#define POOL_REC_HDR sizeof(struct pool_rec)
 
-struct pool *pool_new(size_t capacity, size_t element_size)
+
+static inline size_t pool_cells(struct pool *p, size_t len)
+{
+  return (POOL_REC_HDR + len + p->cell_size - 1) / p->cell_size;
+}
+
+
+/* copy len bytes into the ring at byte offset off, wrapping if needed */
+static inline void pool_copy_in(struct pool *p, size_t off, const void *src, size_t len)
+{
+  size_t first = p->bytes - off;
+
+  if (len <= first) {
+    memcpy(p->data + off, src, len);
+  } else {
+    memcpy(p->data + off, src, first);
+    memcpy(p->data, (const char *)src + first, len - first);
+  }
+}
+
+
+static inline void pool_copy_out(struct pool *p, size_t off, void *dst, size_t len)
+{
+  size_t first = p->bytes - off;
+
+  if (len <= first) {
+    memcpy(dst, p->data + off, len);
+  } else {
+    memcpy(dst, p->data + off, first);
+    memcpy((char *)dst + first, p->data, len - first);
+  }
+}
+
+
+/**
+ * data of a pool: explicit huge pages, else transparent huge pages,
+ * else the heap; populated either way
+ */
+static int pool_alloc_data(struct pool *p, size_t bytes, int flags)
+{
+  if (flags & POOL_HUGEPAGES) {
+    size_t len = (bytes + POOL_HUGEPAGE_SIZE - 1) & ~(POOL_HUGEPAGE_SIZE - 1);
+    void *m = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif
+    if (m == MAP_FAILED) {
+      m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (m != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+        madvise(m, len, MADV_HUGEPAGE);
+#endif
+        memset(m, 0, len);
+      }
+    }
+    if (m != MAP_FAILED) {
+      p->data = m;
+      p->data_mapped = len;
+      return 0;
+    }
+  }
+
+  if (posix_memalign((void **)&p->data, POOL_CACHELINE, bytes) != 0) {
+    p->data = NULL;
+    return -1;
+  }
+  memset(p->data, 0, bytes);
+  return 0;
+}
+
+
+static void pool_free_data(struct pool *p)
+{
+  if (p->data_mapped) {
+    munmap(p->data, p->data_mapped);
+  } else {
+    free(p->data);
+  }
+}
+
+
+struct pool *pool_new(size_t bytes, size_t cell_size, int flags)
 {
   struct pool *p;
-  if ((p = calloc(1, sizeof(struct pool))) == NULL) {
+  size_t i, n = 2, c = POOL_REC_HDR;
+
+  while (c < cell_size) { c <<= 1; }
+  while (n * c < bytes) { n <<= 1; }
+
+  if (posix_memalign((void **)&p, POOL_CACHELINE, sizeof(struct pool)) != 0) {
     return NULL;
   }
-  //请求capacity个element_size大小的空间
-  //calloc 分配内存后自动0化
-  if ((p->data = calloc(capacity, element_size)) == NULL) {
+  memset(p, 0, sizeof(struct pool));
+
+  p->seqs = malloc(n * sizeof(uint64_t));
+  if (p->seqs == NULL || pool_alloc_data(p, n * c, flags) != 0) {
+    free(p->seqs);
     free(p);
     return NULL;
   }
-  p->capacity     = capacity;
-  p->element_size = element_size;
-  p->tail = p->data;
-  //注意，p->data + p->element_size 不是指针+size
-  //p->head指向下一个元素
-  p->head = p->data + p->element_size;
-  
-  pthread_mutex_init(&p->insert_lock, NULL);
-  
+
+  //cell i is free for position i
+  for (i = 0; i < n; i++) {
+    p->seqs[i] = i;
+  }
+
+  p->capacity  = n;
+  p->mask      = n - 1;
+  p->cell_size = c;
+  p->bytes     = n * c;
+  p->head = 0;
+  p->tail = 0;
+
   return p;
 }
 
@@ -66,82 +167,152 @@ struct pool *pool_new(size_t capacity, size_t element_size)
 void pool_free(struct pool *p)
 {
   assert(p);
-  free(p->data);
+  pool_free_data(p);
+  free(p->seqs);
   free(p);
 }
 
 
+int pool_push(struct pool *p, const void *rec, size_t len)
+{
+  return pool_push_n(p, &rec, &len, 1);
+}
+
+
 /**
- * insert element into pool
+ * insert n records into pool
  * If successful, return zero
  */
-int pool_push(struct pool *p, void *ele)
+int pool_push_n(struct pool *p, const void *const *recs, const size_t *lens, size_t n)
 {
   assert(p);
-  assert(ele);
-  
-  /* If successful, pthread_mutex_trylock() will return zero. */
-  if (pthread_mutex_trylock(&p->insert_lock) != 0) {
-    return -1;
+  assert(recs);
+
+  if (n == 0) return 0;
+
+  size_t i, total = 0;
+  for (i = 0; i < n; i++) {
+    if (lens[i] > UINT32_MAX) return -2;
+    total += pool_cells(p, lens[i]);
+  }
+  if (total > p->capacity) return -2;
+
+  uint64_t pos, seq, k;
+  while (1) {
+    pos = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+
+    /*
+     * consumers free their records' cells when done copying, a thief
+     * may be done before the owner: every cell of pos..last must be free
+     */
+    for (k = 0; k < total; k++) {
+      seq = __atomic_load_n(&p->seqs[(pos + k) & p->mask], __ATOMIC_ACQUIRE);
+      if (seq != pos + k) {
+        break;
+      }
+    }
+
+    if (k == total) {
+      if (__sync_bool_compare_and_swap(&p->head, pos, pos + total)) {
+        break;
+      }
+    } else if ((int64_t)(seq - (pos + k)) < 0) {
+      /* 系统过载pool已满, 丢弃数据 */
+      return -2;
+    }
+    /* else: another producer took it, retry */
+  }
+
+  for (i = 0; i < n; i++) {
+    struct pool_rec hdr;
+    size_t off = (pos & p->mask) * p->cell_size;
+
+    hdr.len   = lens[i];
+    hdr.cells = pool_cells(p, lens[i]);
+
+    /* a cell is at least as big as the header, it never wraps */
+    memcpy(p->data + off, &hdr, POOL_REC_HDR);
+    pool_copy_in(p, (off + POOL_REC_HDR) & (p->bytes - 1), recs[i], lens[i]);
+
+    /* the first cell's seq publishes the whole record */
+    __atomic_store_n(&p->seqs[pos & p->mask], pos + 1, __ATOMIC_RELEASE);
+    pos += hdr.cells;
   }
-  
-  void *next_head = pool_next_ele(p, p->head);
-  if (next_head == p->tail) {
-    /* 系统过载pool已满, 丢弃数据 */
-    pthread_mutex_unlock(&p->insert_lock);
-    return -2;
-  }
-  //void *memcpy(void *dest, const void *src, size_t n);
-  memcpy(p->head, ele, p->element_size);
-  p->head = next_head;
-  
-  pthread_mutex_unlock(&p->insert_lock);
   return 0;
 }
 
 
 /**
- * pop an element
- * 由于出队列是单线程的，这里无需加锁
+ * pop a record
+ * the owner and thieves may pop at once: a record is claimed by CAS on
+ * tail, and only copied and freed once it is ours
  */
-int pool_pop(struct pool *p, void *ele)
+int pool_pop(struct pool *p, void *rec, size_t size)
 {
-  void *next_tail = pool_next_ele(p, p->tail);
-  if (next_tail == p->head) {
-    return -1;
+  uint64_t pos, seq;
+  struct pool_rec hdr;
+  size_t off;
+
+  while (1) {
+    pos = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&p->seqs[pos & p->mask], __ATOMIC_ACQUIRE);
+
+    if (seq != pos + 1) {
+      if ((int64_t)(seq - (pos + 1)) < 0) {
+        return -1;  /* empty, or the producer has not published yet */
+      }
+      continue;     /* another consumer took it, tail moved */
+    }
+
+    /* valid as long as tail is still pos: nobody freed the record */
+    off = (pos & p->mask) * p->cell_size;
+    memcpy(&hdr, p->data + off, POOL_REC_HDR);
+
+    if (__sync_bool_compare_and_swap(&p->tail, pos, pos + hdr.cells)) {
+      break;
+    }
   }
-  p->tail = next_tail;
-  memcpy(ele, p->tail, p->element_size);
-  return 0;
+
+  pool_copy_out(p, (off + POOL_REC_HDR) & (p->bytes - 1), rec,
+      hdr.len < size ? hdr.len : size);
+
+  /* free the cells for the next lap, in order */
+  uint32_t i;
+  for (i = 0; i < hdr.cells; i++, pos++) {
+    __atomic_store_n(&p->seqs[pos & p->mask], pos + p->capacity, __ATOMIC_RELEASE);
+  }
+  return (int)hdr.len;
 }
 
 
 /**
- * pool size, 非线程安全
+ * pop a batch, record by record
  */
-size_t pool_size(struct pool *p)
+size_t pool_pop_batch(struct pool *p, void *recs, size_t stride, size_t max)
 {
-  void *tmp_tail = p->tail;
-  void *tmp_head = p->head;
-  
-  long diff = (tmp_head - tmp_tail) / (int)p->element_size;
-  if (diff > 0) {
-    return (size_t)(diff - 1);
-  } else if (diff < 0) {
-    assert(p->capacity + diff - 1 >= 0);
-    return (size_t)(p->capacity + diff - 1);
-  }
-  return 0; // shouldn't be here
+  char *dst = recs;
+  size_t n = 0;
+
+  while (n < max && pool_pop(p, dst + n * stride, stride) >= 0) {
+    n++;
+  }
+  return n;
 }
 
-//p,p->head
-//p,p->tail
-//如果ptr指向最后一个元素，next_ele回卷到p->data
-static inline void *pool_next_ele(struct pool *p, void *ptr)
+
+/**
+ * bytes in use, reserved but unpublished cells are counted
+ */
+size_t pool_size(struct pool *p)
 {
-  if (ptr == p->data + p->element_size*(p->capacity - 1)) {
-    return p->data;
+  uint64_t tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+
+  if ((int64_t)(head - tail) <= 0) {
+    return 0;
   }
-  return ptr + p->element_size;
+  if (head - tail > p->capacity) {
+    return p->bytes;
+  }
+  return (size_t)(head - tail) * p->cell_size;
 }
-
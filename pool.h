@@ -30,31 +30,76 @@
 #ifndef __POOL_H__
 #define __POOL_H__
 
-//#include <stdio.h>
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#define POOL_CACHELINE 64
+
+/* pool_new() flags */
+#define POOL_HUGEPAGES 0x1   /* back data with huge pages, if we can */
+
+/*
+ * bounded multi-producer/multi-consumer ring of variable-length records,
+ * lock free.
+ *
+ * The ring is an array of fixed cells; a record takes as many
+ * consecutive cells as its length (plus a small header) needs, wrapping
+ * around the end of the array if it has to.
+ * Every cell has a sequence number: cell i is free for position pos when
+ * seq == pos. Producers reserve positions by CAS on head, copy, then
+ * publish the record by setting the seq of its first cell to pos + 1;
+ * consumers (a worker, and workers stealing from it) claim a record by
+ * CAS on tail, then copy it out and free all of its cells at once.
+ * Consumers may finish out of order, so a producer checks every cell it
+ * is about to reserve, not just the last one.
+ * head and tail live on their own cache lines.
+ */
 struct pool {
-  size_t element_size;
-  size_t capacity;
-  
-  void *data;
-  void *head;
-  void *tail;
-  
-  pthread_mutex_t insert_lock;
-};
-
-
-struct pool *pool_new(size_t capacity, size_t element_size);
+  size_t cell_size;            /* power of 2 */
+  size_t capacity;             /* cells, power of 2 */
+  size_t mask;
+  size_t bytes;                /* capacity * cell_size */
+
+  uint64_t *seqs;
+  char     *data;
+  size_t    data_mapped;       /* mmap'd length, 0 if malloc'd */
+
+  /* producers */
+  uint64_t head __attribute__((aligned(POOL_CACHELINE)));   /* next position to reserve */
+
+  /* consumer */
+  uint64_t tail __attribute__((aligned(POOL_CACHELINE)));   /* next position to pop */
+} __attribute__((aligned(POOL_CACHELINE)));
+
+
+/**
+ * bytes / cell_size is rounded up to a power of 2, cell_size as well.
+ * All memory is touched here, call it from the consumer's thread
+ * so that it is allocated on the consumer's numa node.
+ */
+struct pool *pool_new(size_t bytes, size_t cell_size, int flags);
 void pool_free(struct pool *p);
 
 /**
- * pool_push()
- * pool_pop() is NOT thread safe
+ * pool_push() and pool_push_n() are thread safe,
+ * pool_push_n() reserves room for n records at once.
+ * If successful, return zero; -2 if there is no room.
+ *
+ * pool_pop() is thread safe as well.
+ * Return the length of the record, -1 if empty.
+ * A record longer than size is truncated.
+ */
+int pool_push  (struct pool *p, const void *rec, size_t len);
+int pool_push_n(struct pool *p, const void *const *recs, const size_t *lens, size_t n);
+int pool_pop   (struct pool *p, void *rec, size_t size);
+
+/**
+ * pop up to max records, the i-th into recs + i * stride
+ * @return number of records popped, 0 if empty
  */
-int pool_push(struct pool *p, void *ele);
-int pool_pop (struct pool *p, void *ele);
+size_t pool_pop_batch(struct pool *p, void *recs, size_t stride, size_t max);
 
+/* bytes in use, approximate, but safe from any thread */
 size_t pool_size(struct pool *p);
 
 #endif
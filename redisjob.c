@@ -29,38 +29,219 @@
 
 #include "redisjob.h"
 #include "thread.h"
+#include "wal.h"
 
+#include <assert.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
-static int ddtrack_job(redisContext *redis,struct trk_item* trk_item);
-static int dashboard_job(redisContext *redis,struct trk_item* trk_item);
-static int redis_hset(redisContext *redis,const char *key, const char *filed,long value);
-static int redis_hincr(redisContext *redis,const char *key, const char *filed,long value);
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+
+extern struct running *g_running;
+
+/* an item out on an async node */
+struct redis_req {
+	struct trk_client_node *node;
+	int pending;            /* replies to come */
+	int failed;
+	struct trk_thread *from; /* the lsn is in its wal, acked once answered */
+	uint64_t lsn;
+	struct trk_item item;   /* trk_item_len() bytes of it */
+};
+
+/* the commands of op can go again after some of them were applied */
+static inline int redis_idempotent(long long op){
+	return op == 2;  /* dashboard, HSET */
+}
+
+static int redis_item_job(struct trk_client_node *node,struct redis_req *req,
+		struct trk_item *trk_item,int script);
+static void redis_async_cb(redisAsyncContext *ac, void *r, void *privdata);
+static void redis_async_connected(const redisAsyncContext *ac, int status);
+static void redis_async_disconnected(const redisAsyncContext *ac, int status);
+
+void *redis_connect(void* n){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	struct timeval tv = {node->timeout_ms / 1000, (node->timeout_ms % 1000) * 1000};
+	redisContext *redis = redisConnectWithTimeout(node->host, node->port, tv);
+
+	if(redis == NULL){
+		return NULL;
+	}
+	/* the script load goes by hiredis, the batches by resp_flush() and resp_read() */
+	if(redis->err || redisSetTimeout(redis, tv) != REDIS_OK){
+		redisFree(redis);
+		return NULL;
+	}
+	return redis;
+}
 
 int redis_proc(void* n,void* item){
+	int ret;
+
 	if(n == NULL || item == NULL){
 		return TRACKD_ERR;
 	}
 
-	struct trk_client_node *node = (struct trk_client_node *)n;
-	struct trk_item *trk_item = (struct trk_item *)item;
+	redis_proc_batch(n, item, 1, &ret);
+	return ret;
+}
 
-	switch(trk_item->op){
-		case 1:
-			//ddtrack
-			return ddtrack_job((redisContext*)node->conn,trk_item);
-		case 2:
-			//dashboard
-			return dashboard_job((redisContext*)node->conn,trk_item);
-		default:
-			return TRACKD_OK;
-			//do nothing
+/**
+ * encode the commands of the items (those set in only, if given) into
+ * the node's buffer and flush them in one write, then parse the replies
+ * back in order. A reply error drops the item it belongs to, the server
+ * refused it; a broken connection fails the items not answered yet and
+ * the node, but drops an item some commands of which were answered
+ * unless they can be applied twice. Without only, ddtrack goes by the
+ * rollup script and an item the server had no script for is set in
+ * noscript. hiredis only connects, see resp.h
+ */
+static int redis_pipeline(struct trk_client_node *node, struct trk_item *trk_items,
+		size_t count, int *rets, const char *only, char *noscript){
+	redisContext *redis = (redisContext *)node->conn;
+	int cmds[TRK_DRAIN_BATCH];
+	size_t appended;
+	size_t i;
+	int j;
+
+	assert(count <= TRK_DRAIN_BATCH);
+	/* hiredis holds nothing that would go before ours or eat our replies */
+	assert(redis->obuf[0] == '\0' && redis->reader->pos == redis->reader->len);
+
+	resp_buf_reset(&node->obuf);
+	resp_buf_reset(&node->ibuf);
+	for(i = 0; i < count; i++){
+		size_t mark = node->obuf.len;
+		if(only && !only[i]){
+			cmds[i] = 0;
+			continue;
+		}
+		cmds[i] = redis_item_job(node, NULL, trk_items + i, only == NULL);
+		/* out of memory, the items so far go */
+		if(cmds[i] < 0){
+			node->obuf.len = mark;
+			break;
+		}
+	}
+	appended = i;
+	if(resp_flush(redis->fd, &node->obuf, node->timeout_ms) != 0){
+		appended = 0;
+	}
+
+	for(i = 0; i < count; i++){
+		if(only && !only[i]){
+			continue;
+		}
+		rets[i] = TRACKD_OK;
+
+		for(j = 0; i < appended && j < cmds[i]; j++){
+			struct resp_reply reply;
+			if(resp_read(redis->fd, &node->ibuf, &reply, node->timeout_ms) != 0){
+				break;
+			}
+			if(reply.type == RESP_ERROR){
+				if(noscript && reply.len >= 8 && memcmp(reply.str, "NOSCRIPT", 8) == 0){
+					noscript[i] = 1;
+				}else{
+					rets[i] = TRK_ITEM_DROP;
+				}
+			}
+		}
+
+		/* no more replies, for this item or the rest */
+		if(i >= appended || j < cmds[i]){
+			rets[i] = j == 0 || redis_idempotent(trk_items[i].op) ?
+				TRACKD_ERR : TRK_ITEM_DROP;
+			for(i++; i < count; i++){
+				if(!only || only[i]){
+					rets[i] = TRACKD_ERR;
+				}
+			}
+			return TRACKD_ERR;
+		}
 	}
 
 	return TRACKD_OK;
 }
 
+/**
+ * the items in one pipeline; those the rollup script was gone for
+ * (a restarted or flushed server) go again as plain commands, and the
+ * script is loaded again for the next batch
+ */
+int redis_proc_batch(void* n, void* items, size_t count, int* rets){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	char noscript[TRK_DRAIN_BATCH] = {0};
+	int ret;
+	size_t i;
+
+	ret = redis_pipeline(node, items, count, rets, NULL, noscript);
+
+	for(i = 0; i < count && !noscript[i]; i++);
+	if(i == count){
+		return ret;
+	}
+
+	node->script_sha[0] = '\0';
+	if(redis_pipeline(node, items, count, rets, noscript, NULL) != TRACKD_OK){
+		ret = TRACKD_ERR;
+	}
+	redis_script_load(node, op_func_get(g_settings, ((struct trk_item *)items)->op));
+	return ret;
+}
+
+static void redis_script_loaded(redisAsyncContext *ac, void *r, void *privdata){
+	struct trk_client_node *node = (struct trk_client_node *)privdata;
+	redisReply *reply = (redisReply *)r;
+
+	if(ac->data && reply && reply->type == REDIS_REPLY_STRING &&
+			reply->len < sizeof(node->script_sha)){
+		memcpy(node->script_sha, reply->str, reply->len);
+		node->script_sha[reply->len] = '\0';
+	}
+}
+
+/**
+ * the rollup of ddtrack as a script: HINCRBY of every configured
+ * prefix of the second field, so an event is a single EVALSHA
+ */
+int redis_script_load(void* n, struct func *f){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	char script[512], *p = script;
+	redisReply *reply;
+	int i;
+
+	node->script_sha[0] = '\0';
+	if(f == NULL || f->op != 1 || !f->rollup_script || node->conn == NULL){
+		return TRACKD_OK;
+	}
+
+	p += sprintf(p, "local f, v = ARGV[1], ARGV[2] for _, n in ipairs({");
+	for(i = 0; i < f->num_rollup; i++){
+		p += sprintf(p, i ? ",%d" : "%d", f->rollup[i]);
+	}
+	sprintf(p, "}) do redis.call('HINCRBY', KEYS[1], string.sub(f, 1, n), v) end return 0");
+
+	if(node->async){
+		return redisAsyncCommand((redisAsyncContext *)node->conn, redis_script_loaded,
+				node, "SCRIPT LOAD %s", script) == REDIS_OK ? TRACKD_OK : TRACKD_ERR;
+	}
+
+	reply = redisCommand((redisContext *)node->conn, "SCRIPT LOAD %s", script);
+	if(reply == NULL){
+		return TRACKD_ERR;
+	}
+	if(reply->type == REDIS_REPLY_STRING && reply->len < sizeof(node->script_sha)){
+		memcpy(node->script_sha, reply->str, reply->len);
+		node->script_sha[reply->len] = '\0';
+	}
+	freeReplyObject(reply);
+	return node->script_sha[0] ? TRACKD_OK : TRACKD_ERR;
+}
+
 int redis_finalizer(void* n){
 	if (n == NULL){
 		return TRACKD_OK;
@@ -70,16 +251,184 @@ int redis_finalizer(void* n){
 	return TRACKD_OK;
 }
 
-static int dashboard_job(redisContext *redis,struct trk_item* trk_item){
+/**
+ * an async connection of n on base, NULL if it can't even be started;
+ * one that fails later hangs up and sets last_err_time of n
+ */
+void *redis_async_connect(void* n, struct event_base *base, struct func *f){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	redisAsyncContext *ac = redisAsyncConnect(node->host, node->port);
+
+	if(ac == NULL){
+		return NULL;
+	}
+	struct timeval tv = {node->timeout_ms / 1000, (node->timeout_ms % 1000) * 1000};
+	if(ac->err || redisLibeventAttach(ac, base) != REDIS_OK ||
+			(node->timeout_ms > 0 && redisAsyncSetTimeout(ac, tv) != REDIS_OK)){
+		redisAsyncFree(ac);
+		return NULL;
+	}
+	ac->data = node;
+	redisAsyncSetConnectCallback(ac, redis_async_connected);
+	redisAsyncSetDisconnectCallback(ac, redis_async_disconnected);
+
+	node->conn = ac;
+	redis_script_load(node, f);
+	return ac;
+}
+
+/* hiredis frees ac after these, the node reconnects after TRK_ERR_IGNORE_TIME */
+static void redis_async_connected(const redisAsyncContext *ac, int status){
+	struct trk_client_node *node = (struct trk_client_node *)ac->data;
+
+	if(status != REDIS_OK && node && node->conn == ac){
+		node->conn = NULL;
+		node->last_err_time = time(NULL);
+	}
+}
+
+static void redis_async_disconnected(const redisAsyncContext *ac, int status){
+	redis_async_connected(ac, REDIS_ERR);
+}
+
+/**
+ * send the commands of an item off and be done with it: they go out in
+ * one write with the rest of the batch once the worker is back in its
+ * event loop, redis_async_cb() takes the replies. The item's lsn goes
+ * with them, cleared in the item so the batch does not ack it
+ */
+int redis_async_proc(void* n, void* item){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	struct trk_item *trk_item = (struct trk_item *)item;
+	struct redis_req *req;
+	size_t len;
+
+	if(node == NULL || trk_item == NULL || node->conn == NULL){
+		return TRACKD_ERR;
+	}
+
+	len = trk_item_len(trk_item);
+	req = malloc(offsetof(struct redis_req, item) + len);
+	if(req == NULL){
+		return TRACKD_ERR;
+	}
+	req->node    = node;
+	req->pending = 0;
+	req->failed  = 0;
+	req->from    = trk_thread_self ? trk_thread_self->batch_from : NULL;
+	req->lsn     = req->from && req->from->wal ? trk_item->lsn : 0;
+	memcpy(&req->item, trk_item, len);
+	req->item.lsn = 0;
+
+	if(redis_item_job(node, req, &req->item, 1) < 0){
+		req->failed = 1;
+	}
+	/* nothing went out, the caller tries the next node */
+	if(req->pending == 0){
+		int ret = req->failed ? TRACKD_ERR : TRACKD_OK;
+		free(req);
+		return ret;
+	}
+	if(req->lsn){
+		trk_item->lsn = 0;
+	}
+	return TRACKD_OK;
+}
+
+int redis_async_proc_batch(void* n, void* items, size_t count, int* rets){
+	struct trk_item *trk_items = (struct trk_item *)items;
+	int ret = TRACKD_OK;
+	size_t i;
+
+	for(i = 0; i < count; i++){
+		rets[i] = redis_async_proc(n, trk_items + i);
+		if(rets[i] != TRACKD_OK){
+			ret = TRACKD_ERR;
+		}
+	}
+	return ret;
+}
+
+/**
+ * a reply to an item's command: NOSCRIPT sends the item again as plain
+ * commands, any other error, a lost connection or the node's timeout
+ * fails it. With all its replies in, the item is acked in the wal; a
+ * failed one goes to the op's next node if its commands can be applied
+ * twice, else it is dropped: some may have been applied already
+ */
+static void redis_async_cb(redisAsyncContext *ac, void *r, void *privdata){
+	struct redis_req *req = (struct redis_req *)privdata;
+	struct trk_client_node *node = req->node;
+	redisReply *reply = (redisReply *)r;
+
+	/* finalized, the worker is closing its sinks */
+	if(ac->data == NULL){
+		if(--req->pending == 0){
+			free(req);
+		}
+		return;
+	}
+
+	node->inflight--;
+	if(reply == NULL){
+		req->failed = 1;
+	}else if(reply->type == REDIS_REPLY_ERROR){
+		if(reply->str && strncmp(reply->str, "NOSCRIPT", 8) == 0){
+			if(node->script_sha[0]){
+				redis_script_load(node, op_func_get(g_settings, req->item.op));
+			}
+			if(redis_item_job(node, req, &req->item, 0) < 0){
+				req->failed = 1;
+			}
+		}else{
+			req->failed = 1;
+		}
+	}
+
+	if(--req->pending == 0){
+		if(req->failed && redis_idempotent(req->item.op)){
+			node->last_err_time = time(NULL);
+			req->item.lsn = req->lsn;
+			trk_thread_resink(&req->item, req->from);
+		}else{
+			if(req->failed){
+				node->last_err_time = time(NULL);
+				__sync_fetch_and_add(&g_running->discarded, 1);
+			}
+			if(req->lsn){
+				wal_ack(req->from->wal, &req->lsn, 1);
+			}
+		}
+		free(req);
+	}
+
+	if(node->inflight <= node->max_inflight / 2){
+		trk_thread_sink_ready();
+	}
+}
+
+int redis_async_finalizer(void* n){
+	redisAsyncContext *ac = (redisAsyncContext *)n;
+
+	if (ac == NULL){
+		return TRACKD_OK;
+	}
+
+	/* what is still out is dropped, see redis_async_cb() */
+	ac->data = NULL;
+	redisAsyncFree(ac);
+	return TRACKD_OK;
+}
+
+static void dashboard_parse(const struct trk_item *trk_item,
+		char *redishkey, char *redishfield, long *data){
 	//date=20131203&date=123&t=xx
 	static const char *delimiter = "&";
 
-	char redishkey[REDIS_HKEY_MAX_LENGTH];
-	char redishfield[REDIS_HFIELD_MAX_LENGTH];
-
-	snprintf(redishkey,REDIS_HKEY_MAX_LENGTH,"dashboard_%d",trk_item->trk_id);
+	snprintf(redishkey,REDIS_HKEY_MAX_LENGTH,"dashboard_%llu",
+			(unsigned long long)trk_item->trk_id);
 
-	long data = 0;
+	*data = 0;
 	//time_t t = 0;
 	//struct tm *local_time = NULL;
 
@@ -88,7 +437,7 @@ static int dashboard_job(redisContext *redis,struct trk_item* trk_item){
 	char *pch = strtok_r(str_cpy, delimiter, &brkt);
 	while (pch != NULL) {
 		if (memcmp(pch, "data=", 5) == 0) {
-			data = atol(pch+5);
+			*data = atol(pch+5);
 		} else if (memcmp(pch, "date=", 5) == 0) {
 			snprintf(redishfield,REDIS_HFIELD_MAX_LENGTH,"%s",pch+5);
 		} else if (memcmp(pch, "t=", 2) == 0) {
@@ -98,112 +447,230 @@ static int dashboard_job(redisContext *redis,struct trk_item* trk_item){
 		pch = strtok_r(NULL, delimiter, &brkt);
 	}
 	free(str_cpy);
-
-	redis_hset(redis,redishkey,redishfield,data);
-
-	return TRACKD_OK;
 }
 
-static int ddtrack_job(redisContext *redis,struct trk_item *trk_item){
+/* the second field, cut to the rollup prefixes for the coarser ones */
+static void ddtrack_parse(const struct trk_item *trk_item,
+		char *redishkey, char *redishfield, long *data){
 	static const char *delimiter = "&";
-	static const char *op_1 = "ddtrack_";
 
 	//printf("query_str:%s\n",trk_item->query_str);
-	char redishkey[REDIS_HKEY_MAX_LENGTH];
-	char redishfield[REDIS_HFIELD_MAX_LENGTH];
-
-	int hkey_len = strlen(op_1);
-	strncpy( redishkey, op_1 , hkey_len);
+	snprintf(redishkey,REDIS_HKEY_MAX_LENGTH,"ddtrack_%llu",
+			(unsigned long long)trk_item->trk_id);
 
-	long data = 0;
+	*data = 0;
 	time_t t = 0;
-	struct tm *local_time = NULL;
+	struct tm local_time;
 
 	char *brkt;
 	char *str_cpy = strdup(trk_item->query_str);
 	char *pch = strtok_r(str_cpy, delimiter, &brkt);
 	while (pch != NULL) {
 		if (memcmp(pch, "data=", 5) == 0) {
-			data = atoi(pch+5);
-		} else if (memcmp(pch, "trk_id=", 7) == 0) {
-			strncpy( redishkey + hkey_len, pch + 7, strlen(pch) - 7);
-			hkey_len += strlen(pch) - 7;
-			redishkey[hkey_len++] = '\0';
+			*data = atoi(pch+5);
 		} else if (memcmp(pch, "t=", 2) == 0) {
 			t = atoi(pch+2);
-			local_time = localtime(&t); 
-			strftime(redishfield, sizeof(redishfield), "%Y%m%d%H%M%S", local_time);
+			localtime_r(&t, &local_time);
+			strftime(redishfield, REDIS_HFIELD_MAX_LENGTH, "%Y%m%d%H%M%S", &local_time);
 		}
 		pch = strtok_r(NULL, delimiter, &brkt);
 	}
 	free(str_cpy);
+}
 
-	//incr second
-	redis_hincr(redis,redishkey,redishfield,data);
-
-	//incr minute
-	redishfield[12] = '\0';
-	redis_hincr(redis,redishkey,redishfield,data);
+/**
+ * "cmd key field value", or "cmd script 1 key field value" for EVAL and
+ * EVALSHA, encoded into the node's buffer: left there for the pipeline
+ * of a blocking node or, with req, sent off on an async node with its
+ * reply to redis_async_cb()
+ */
+static int redis_emit(struct trk_client_node *node, struct redis_req *req,
+		const char *cmd, const char *script, const char *key, const char *field,
+		long long value){
+	struct resp_buf *b = &node->obuf;
+	int r;
+
+	if(req){
+		resp_buf_reset(b);
+	}
+	if(resp_begin(b, script ? 6 : 4) != 0 || resp_arg_str(b, cmd) != 0 ||
+			(script && (resp_arg_str(b, script) != 0 || resp_arg(b, "1", 1) != 0)) ||
+			resp_arg_str(b, key) != 0 || resp_arg_str(b, field) != 0 ||
+			resp_arg_ll(b, value) != 0){
+		return REDIS_ERR;
+	}
+	if(!req){
+		return REDIS_OK;
+	}
 
-	//incr hour
-	redishfield[10] = '\0';
-	redis_hincr(redis,redishkey,redishfield,data);
+	r = redisAsyncFormattedCommand((redisAsyncContext *)node->conn,
+			redis_async_cb, req, b->data, b->len);
+	if(r == REDIS_OK){
+		req->pending++;
+		node->inflight++;
+	}
+	return r;
+}
 
-	//incr day
-	redishfield[8] = '\0';
-	redis_hincr(redis,redishkey,redishfield,data);
+/* commands appended, -1 on failure */
+static int dashboard_job(struct trk_client_node *node,struct redis_req *req,
+		struct trk_item *trk_item){
+	char redishkey[REDIS_HKEY_MAX_LENGTH];
+	char redishfield[REDIS_HFIELD_MAX_LENGTH];
+	long data;
 
-	//incr month
-	redishfield[6] = '\0';
-	redis_hincr(redis,redishkey,redishfield,data);
+	dashboard_parse(trk_item, redishkey, redishfield, &data);
 
-	//incr year
-	redishfield[4] = '\0';
-	redis_hincr(redis,redishkey,redishfield,data);
+	if(redis_emit(node, req, "HSET", NULL,
+				redishkey,redishfield,data) != REDIS_OK){
+		return -1;
+	}
 
-	return TRACKD_OK;
+	return 1;
 }
 
-static int redis_hset(redisContext *redis,const char *key, const char *field,long value){
-	redisReply *reply = NULL;
-	void *ret = NULL;
+/* commands appended, -1 on failure */
+static int ddtrack_job(struct trk_client_node *node,struct redis_req *req,
+		struct trk_item *trk_item,int script){
+	struct func *f = op_func_get(g_settings, trk_item->op);
+	char redishkey[REDIS_HKEY_MAX_LENGTH];
+	char redishfield[REDIS_HFIELD_MAX_LENGTH];
+	long data;
+	int i;
+
+	ddtrack_parse(trk_item, redishkey, redishfield, &data);
 
-	ret = redisCommand(redis,"HSET %s %s %lld", key, field,value);
-	if( ret == NULL){
-		return TRACKD_ERR;
+	/* one command, the server does the rollup */
+	if(script && node->script_sha[0]){
+		if(redis_emit(node, req, "EVALSHA", node->script_sha,
+					redishkey,redishfield,data) != REDIS_OK){
+			return -1;
+		}
+		return 1;
 	}
 
-	reply = (redisReply *)ret;
-	if(reply->integer > 0){
-		freeReplyObject(reply);
-		return TRACKD_OK;
-	}else{
-		freeReplyObject(reply);
-		//something must be wrong
-		return TRACKD_ERR;
+	//incr second, minute, hour, day, month and year, as configured
+	for(i = 0; i < f->num_rollup; i++){
+		redishfield[f->rollup[i]] = '\0';
+		if(redis_emit(node, req, "HINCRBY", NULL,
+					redishkey,redishfield,data) != REDIS_OK){
+			return -1;
+		}
 	}
-}
 
-static int redis_hincr(redisContext *redis,const char *key, const char *field,long value){
-	//printf("redishkey:%s;redishfield:%s;data:%ld\n",key,field,value);
-	redisReply *reply = NULL;
-	void *ret = NULL;
+	return f->num_rollup;
+}
 
-	ret = redisCommand(redis,"HINCRBY %s %s %lld", key, field,value);
-	if( ret == NULL){
-		return TRACKD_ERR;
+/* commands appended for an item, -1 on failure */
+static int redis_item_job(struct trk_client_node *node,struct redis_req *req,
+		struct trk_item *trk_item,int script){
+	switch(trk_item->op){
+		case 1:
+			//ddtrack
+			return ddtrack_job(node, req, trk_item, script);
+		case 2:
+			//dashboard
+			return dashboard_job(node, req, trk_item);
+		default:
+			//do nothing
+			return 0;
 	}
+}
 
-	reply = (redisReply *)ret;
-	//printf("reply:%lld\n",reply->integer);
-	if(reply->integer > 0){
-		freeReplyObject(reply);
-		return TRACKD_OK;
-	}else{
-		freeReplyObject(reply);
-		//something must be wrong
-		return TRACKD_ERR;
+int redis_agg(struct agg *a, void* item, int func){
+	struct trk_item *trk_item = (struct trk_item *)item;
+	char redishkey[REDIS_HKEY_MAX_LENGTH];
+	char redishfield[REDIS_HFIELD_MAX_LENGTH];
+	long data;
+	int i;
+
+	struct func *f = op_func_get(g_settings, trk_item->op);
+
+	switch(trk_item->op){
+		case 1:
+			if(agg_full(a, f->num_rollup)){
+				return TRACKD_ERR;
+			}
+			ddtrack_parse(trk_item, redishkey, redishfield, &data);
+			for(i = 0; i < f->num_rollup; i++){
+				redishfield[f->rollup[i]] = '\0';
+				agg_add(a, redishkey, redishfield, func, data);
+			}
+			return TRACKD_OK;
+		case 2:
+			if(agg_full(a, 1)){
+				return TRACKD_ERR;
+			}
+			dashboard_parse(trk_item, redishkey, redishfield, &data);
+			agg_add(a, redishkey, redishfield, func, data);
+			return TRACKD_OK;
+		default:
+			return TRACKD_OK;
 	}
 }
 
+/* min and max keep the smaller or bigger of the stored and new value */
+static const char *agg_scripts[] = {
+	[AGG_MIN] = "local v = redis.call('HGET', KEYS[1], ARGV[1]) "
+		"if not v or tonumber(ARGV[2]) < tonumber(v) then "
+		"redis.call('HSET', KEYS[1], ARGV[1], ARGV[2]) end return 0",
+	[AGG_MAX] = "local v = redis.call('HGET', KEYS[1], ARGV[1]) "
+		"if not v or tonumber(ARGV[2]) > tonumber(v) then "
+		"redis.call('HSET', KEYS[1], ARGV[1], ARGV[2]) end return 0",
+};
+
+int redis_agg_flush(void* n, struct agg_entry *entries, size_t count){
+	struct trk_client_node *node = (struct trk_client_node *)n;
+	redisContext *redis = (redisContext *)node->conn;
+	int ret = TRACKD_OK;
+	size_t i, appended;
+
+	assert(redis->obuf[0] == '\0' && redis->reader->pos == redis->reader->len);
+	resp_buf_reset(&node->obuf);
+	resp_buf_reset(&node->ibuf);
+	for(i = 0; i < count; i++){
+		struct agg_entry *e = entries + i;
+		size_t mark = node->obuf.len;
+		int r;
+
+		switch(e->func){
+			case AGG_SUM:
+			case AGG_COUNT:
+				r = redis_emit(node, NULL, "HINCRBY", NULL, e->key, e->field, e->value);
+				break;
+			case AGG_MIN:
+			case AGG_MAX:
+				r = redis_emit(node, NULL, "EVAL", agg_scripts[e->func],
+						e->key, e->field, e->value);
+				break;
+			default:
+				r = redis_emit(node, NULL, "HSET", NULL, e->key, e->field, e->value);
+		}
+		if(r != REDIS_OK){
+			node->obuf.len = mark;
+			break;
+		}
+	}
+	appended = i;
+	if(resp_flush(redis->fd, &node->obuf, node->timeout_ms) != 0){
+		appended = 0;
+	}
+
+	for(i = 0; i < count; i++){
+		struct resp_reply reply;
 
+		entries[i].err = 0;
+		if(i >= appended || resp_read(redis->fd, &node->ibuf, &reply, node->timeout_ms) != 0){
+			for(; i < count; i++){
+				entries[i].err = 1;
+			}
+			return TRACKD_ERR;
+		}
+		if(reply.type == RESP_ERROR){
+			entries[i].err = 1;
+			ret = TRACKD_ERR;
+		}
+	}
+
+	return ret;
+}
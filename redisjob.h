@@ -30,13 +30,43 @@
 #ifndef __REDISJOB_H__
 #define __REDISJOB_H__
 
+#include "agg.h"
+#include "trackd.h"
+
+#include <event.h>
 #include <hiredis/hiredis.h>
 
 #define REDIS_HKEY_MAX_LENGTH 32
 #define REDIS_HFIELD_MAX_LENGTH 32
 
 
+/**
+ * a blocking connection of node n, NULL if it can't connect; its
+ * connect and every command wait node->timeout_ms at most
+ */
+void *redis_connect(void* n);
 int redis_proc(void* n,void* item);
+
+/* count <= TRK_DRAIN_BATCH items in one pipeline, rets[i] of each */
+int redis_proc_batch(void* n, void* items, size_t count, int* rets);
 int redis_finalizer(void* n);
 
+/**
+ * async nodes: the connection on the worker's event loop, see
+ * redis_async_proc() and "redis_async" in [op_func_N_option]
+ */
+void *redis_async_connect(void* n, struct event_base *base, struct func *f);
+int redis_async_proc(void* n, void* item);
+int redis_async_proc_batch(void* n, void* items, size_t count, int* rets);
+int redis_async_finalizer(void* n);
+
+/* register the rollup script of op f on node, on every connect */
+int redis_script_load(void* n, struct func *f);
+
+/* fold an item into a, TRACKD_ERR if a is too full to take it */
+int redis_agg(struct agg *a, void* item, int func);
+
+/* write out entries taken from an agg, a failed one gets err set */
+int redis_agg_flush(void* n, struct agg_entry *entries, size_t count);
+
 #endif
@@ -0,0 +1,325 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "resp.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bytes asked from the socket at least, per read */
+#define RESP_READ_CHUNK 16384
+
+
+void resp_buf_free(struct resp_buf *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->len = b->pos = b->cap = 0;
+}
+
+
+/* room for n more bytes, kept once grown */
+static int resp_reserve(struct resp_buf *b, size_t n)
+{
+	size_t cap = b->cap ? b->cap : 4096;
+	char *data;
+
+	if (b->len + n <= b->cap) {
+		return 0;
+	}
+	while (cap < b->len + n) {
+		cap <<= 1;
+	}
+	data = realloc(b->data, cap);
+	if (!data) {
+		return -1;
+	}
+	b->data = data;
+	b->cap  = cap;
+	return 0;
+}
+
+
+/* "<c><n>\r\n", n in decimal */
+static int resp_header(struct resp_buf *b, char c, long long n)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long u = n < 0 ? -(unsigned long long)n : (unsigned long long)n;
+
+	*--p = '\n';
+	*--p = '\r';
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (n < 0) {
+		*--p = '-';
+	}
+	*--p = c;
+
+	if (resp_reserve(b, tmp + sizeof(tmp) - p) != 0) {
+		return -1;
+	}
+	memcpy(b->data + b->len, p, tmp + sizeof(tmp) - p);
+	b->len += tmp + sizeof(tmp) - p;
+	return 0;
+}
+
+
+int resp_begin(struct resp_buf *b, int argc)
+{
+	return resp_header(b, '*', argc);
+}
+
+
+int resp_arg(struct resp_buf *b, const char *s, size_t len)
+{
+	if (resp_header(b, '$', len) != 0 || resp_reserve(b, len + 2) != 0) {
+		return -1;
+	}
+	memcpy(b->data + b->len, s, len);
+	b->data[b->len + len]     = '\r';
+	b->data[b->len + len + 1] = '\n';
+	b->len += len + 2;
+	return 0;
+}
+
+
+int resp_arg_str(struct resp_buf *b, const char *s)
+{
+	return resp_arg(b, s, strlen(s));
+}
+
+
+int resp_arg_ll(struct resp_buf *b, long long v)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0) {
+		*--p = '-';
+	}
+	return resp_arg(b, p, tmp + sizeof(tmp) - p);
+}
+
+
+static uint64_t resp_clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* deadline of a call taking timeout_ms, 0 for none */
+static uint64_t resp_deadline(int timeout_ms)
+{
+	return timeout_ms > 0 ? resp_clock_ms() + timeout_ms : 0;
+}
+
+
+/* fd ready for events before deadline, -1 if not or on error */
+static int resp_wait(int fd, short events, uint64_t deadline)
+{
+	struct pollfd pfd = {fd, events, 0};
+	int left = -1;
+
+	while (1) {
+		if (deadline) {
+			uint64_t now = resp_clock_ms();
+			if (now >= deadline) {
+				return -1;
+			}
+			left = (int)(deadline - now);
+		}
+		switch (poll(&pfd, 1, left)) {
+			case 1:  return 0;
+			case 0:  return -1;
+			default: if (errno != EINTR) return -1;
+		}
+	}
+}
+
+
+/* the socket blocks: send and recv without waiting, resp_wait() does */
+int resp_flush(int fd, struct resp_buf *b, int timeout_ms)
+{
+	uint64_t deadline = resp_deadline(timeout_ms);
+	size_t off = 0;
+
+	while (off < b->len) {
+		ssize_t n = send(fd, b->data + off, b->len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (resp_wait(fd, POLLOUT, deadline) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		off += n;
+	}
+	resp_buf_reset(b);
+	return 0;
+}
+
+
+/* the decimal in [s, e), -1 if there is none or anything else */
+static int resp_ll(const char *s, const char *e, long long *v)
+{
+	int neg = s < e && *s == '-';
+	unsigned long long u = 0;
+
+	s += neg;
+	if (s == e || e - s > 19) {
+		return -1;
+	}
+	for (; s < e; s++) {
+		if (*s < '0' || *s > '9') {
+			return -1;
+		}
+		u = u * 10 + (*s - '0');
+	}
+	*v = neg ? -(long long)u : (long long)u;
+	return 0;
+}
+
+
+int resp_parse(const char *p, size_t len, struct resp_reply *r)
+{
+	const char *e;
+	long long n;
+
+	if (len < 3) {
+		return 0;
+	}
+	e = memchr(p + 1, '\r', len - 1);
+	if (!e || e + 1 == p + len) {
+		return 0;
+	}
+	if (e[1] != '\n') {
+		return -1;
+	}
+
+	r->type = p[0];
+	r->str  = NULL;
+	r->len  = 0;
+	switch (p[0]) {
+		case RESP_STATUS:
+		case RESP_ERROR:
+			r->str = p + 1;
+			r->len = e - p - 1;
+			return e + 2 - p;
+		case RESP_INTEGER:
+			if (resp_ll(p + 1, e, &r->integer) != 0) {
+				return -1;
+			}
+			return e + 2 - p;
+		case RESP_BULK:
+			if (resp_ll(p + 1, e, &n) != 0 || n < -1) {
+				return -1;
+			}
+			if (n == -1) {
+				return e + 2 - p;
+			}
+			if ((size_t)(e + 2 - p) + n + 2 > len) {
+				return 0;
+			}
+			if (e[2 + n] != '\r' || e[3 + n] != '\n') {
+				return -1;
+			}
+			r->str = e + 2;
+			r->len = n;
+			return e + 4 + n - p;
+		default:
+			return -1;
+	}
+}
+
+
+int resp_read(int fd, struct resp_buf *b, struct resp_reply *r, int timeout_ms)
+{
+	uint64_t deadline = resp_deadline(timeout_ms);
+	ssize_t n;
+	int used;
+
+	while (1) {
+		if (b->pos < b->len) {
+			used = resp_parse(b->data + b->pos, b->len - b->pos, r);
+			if (used > 0) {
+				b->pos += used;
+				return 0;
+			}
+			if (used < 0) {
+				return -1;
+			}
+		}
+
+		/* keep the partial reply at the front, read more after it */
+		if (b->pos > 0) {
+			memmove(b->data, b->data + b->pos, b->len - b->pos);
+			b->len -= b->pos;
+			b->pos  = 0;
+		}
+		if (resp_reserve(b, RESP_READ_CHUNK) != 0) {
+			return -1;
+		}
+
+		n = recv(fd, b->data + b->len, b->cap - b->len, MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (resp_wait(fd, POLLIN, deadline) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		b->len += n;
+	}
+}
@@ -0,0 +1,97 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RESP_H__
+#define __RESP_H__
+
+#include <stddef.h>
+
+/*
+ * the redis protocol, just what the sinks send and get back: commands
+ * are encoded into a buffer that is reused from batch to batch, replies
+ * are parsed in place without allocating. A connection has a buffer
+ * for each way, owned by one worker, no locking.
+ */
+struct resp_buf {
+	char   *data;
+	size_t  len;     /* bytes in data */
+	size_t  pos;     /* of the next reply, input buffers only */
+	size_t  cap;
+};
+
+/* reply types, the leading byte; a nil bulk is RESP_BULK with str NULL */
+#define RESP_STATUS  '+'
+#define RESP_ERROR   '-'
+#define RESP_INTEGER ':'
+#define RESP_BULK    '$'
+
+struct resp_reply {
+	int         type;
+	long long   integer;
+	const char *str;     /* status, error and bulk, in the buffer */
+	size_t      len;
+};
+
+static inline void resp_buf_reset(struct resp_buf *b)
+{
+	b->len = b->pos = 0;
+}
+
+void resp_buf_free(struct resp_buf *b);
+
+/**
+ * a command of argc arguments, each appended by resp_arg*()
+ * @return 0, -1 out of memory
+ */
+int resp_begin(struct resp_buf *b, int argc);
+int resp_arg(struct resp_buf *b, const char *s, size_t len);
+int resp_arg_str(struct resp_buf *b, const char *s);
+int resp_arg_ll(struct resp_buf *b, long long v);
+
+/**
+ * write all of b to fd and reset it, waiting timeout_ms at most in all
+ * (0 for no limit)
+ * @return 0, -1 on error or timeout
+ */
+int resp_flush(int fd, struct resp_buf *b, int timeout_ms);
+
+/**
+ * the reply at p, of len bytes at most
+ * @return bytes of it, 0 if incomplete, -1 if bad or an array
+ */
+int resp_parse(const char *p, size_t len, struct resp_reply *r);
+
+/**
+ * the next reply on fd, valid until the next call, waiting timeout_ms
+ * at most (0 for no limit)
+ * @return 0, -1 on error, eof or timeout
+ */
+int resp_read(int fd, struct resp_buf *b, struct resp_reply *r, int timeout_ms);
+
+#endif
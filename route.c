@@ -0,0 +1,126 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "route.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+struct route *route_new(int nworkers)
+{
+	struct route *r;
+	int b;
+
+	assert(nworkers > 0);
+	r = calloc(1, sizeof(struct route));
+	if (!r) {
+		return NULL;
+	}
+
+	r->nworkers = nworkers;
+	r->seen = calloc((size_t)nworkers * ROUTE_BUCKETS, sizeof(uint32_t));
+	if (!r->seen) {
+		free(r);
+		return NULL;
+	}
+	for (b = 0; b < ROUTE_BUCKETS; b++) {
+		r->owner[b] = b % nworkers;
+	}
+	return r;
+}
+
+
+void route_free(struct route *r)
+{
+	if (r) {
+		free(r->seen);
+	}
+	free(r);
+}
+
+
+int route_rebalance(struct route *r, uint32_t *const *hits, int max_moves)
+{
+	uint64_t load[ROUTE_BUCKETS];
+	uint64_t *wl;
+	uint64_t total = 0;
+	int b, w, moves = 0;
+
+	wl = calloc(r->nworkers, sizeof(uint64_t));
+	if (!wl) {
+		return 0;
+	}
+
+	/* a bucket may have moved since the last pass, sum all workers */
+	for (b = 0; b < ROUTE_BUCKETS; b++) {
+		load[b] = 0;
+		for (w = 0; w < r->nworkers; w++) {
+			uint32_t *seen = &r->seen[(size_t)w * ROUTE_BUCKETS + b];
+			uint32_t now = __atomic_load_n(&hits[w][b], __ATOMIC_RELAXED);
+			load[b] += now - *seen;
+			*seen = now;
+		}
+		wl[r->owner[b]] += load[b];
+		total += load[b];
+	}
+
+	while (total > 0 && moves < max_moves) {
+		int hi = 0, lo = 0, best = -1;
+
+		for (w = 1; w < r->nworkers; w++) {
+			if (wl[w] > wl[hi]) hi = w;
+			if (wl[w] < wl[lo]) lo = w;
+		}
+		if (wl[hi] * r->nworkers * 100 <= total * (100 + ROUTE_SKEW_PCT)) {
+			break;
+		}
+
+		/* the hottest bucket of hi that does not overshoot lo */
+		uint64_t gap = (wl[hi] - wl[lo]) / 2;
+		for (b = 0; b < ROUTE_BUCKETS; b++) {
+			if (r->owner[b] == hi && load[b] > 0 && load[b] <= gap &&
+					(best < 0 || load[b] > load[best])) {
+				best = b;
+			}
+		}
+		if (best < 0) {
+			break;  /* a single bucket is the skew, moving it does not help */
+		}
+
+		__atomic_store_n(&r->owner[best], lo, __ATOMIC_RELAXED);
+		wl[hi] -= load[best];
+		wl[lo] += load[best];
+		moves++;
+	}
+
+	free(wl);
+	return moves;
+}
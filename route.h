@@ -0,0 +1,81 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROUTE_H__
+#define __ROUTE_H__
+
+#include <stdint.h>
+
+/*
+ * key-affinity routing: (op, trk_id) hashes to one of ROUTE_BUCKETS
+ * buckets and every bucket belongs to a worker, so a tracker's events
+ * always meet the same worker. Workers count the events of each bucket
+ * they process; route_rebalance() moves buckets off workers that carry
+ * more than their share. Events queued before a move are still sunk by
+ * the old owner.
+ */
+#define ROUTE_BUCKETS   1024   /* power of 2 */
+
+/* a worker is rebalanced when its load is above average by this much */
+#define ROUTE_SKEW_PCT  20
+
+struct route {
+	int nworkers;
+	uint16_t owner[ROUTE_BUCKETS];
+	uint32_t *seen;        /* the hits of the last pass, per worker and bucket */
+};
+
+static inline uint32_t route_bucket(uint32_t op, uint64_t trk_id)
+{
+	/* splitmix64 finalizer */
+	uint64_t x = trk_id ^ ((uint64_t)op << 48);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (uint32_t)x & (ROUTE_BUCKETS - 1);
+}
+
+static inline int route_pick(const struct route *r, uint32_t op, uint64_t trk_id)
+{
+	return __atomic_load_n(&r->owner[route_bucket(op, trk_id)], __ATOMIC_RELAXED);
+}
+
+/* buckets are dealt to nworkers in turn */
+struct route *route_new(int nworkers);
+void route_free(struct route *r);
+
+/**
+ * move hot buckets to the least loaded workers, at most max_moves,
+ * hits[w] is worker w's per-bucket counters: only it writes them, they
+ * only go up (wrapping), the load is what they grew since the last pass
+ * @return number of buckets moved
+ */
+int route_rebalance(struct route *r, uint32_t *const *hits, int max_moves);
+
+#endif
@@ -0,0 +1,210 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104) */
+
+#include "sha256.h"
+#include "md5.h"
+
+#include <string.h>
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define EP0(x) (ROTR(x, 2)  ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define EP1(x) (ROTR(x, 6)  ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SIG0(x) (ROTR(x, 7)  ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_transform(uint32_t state[8], const unsigned char block[SHA256_BLOCK_LEN])
+{
+	uint32_t a, b, c, d, e, f, g, h, t1, t2, w[64];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) |
+			((uint32_t)block[i*4+2] << 8) | (uint32_t)block[i*4+3];
+	}
+	for (; i < 64; i++) {
+		w[i] = SIG1(w[i-2]) + w[i-7] + SIG0(w[i-15]) + w[i-16];
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + EP1(e) + CH(e, f, g) + K[i] + w[i];
+		t2 = EP0(a) + MAJ(a, b, c);
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t used = ctx->count % SHA256_BLOCK_LEN;
+
+	ctx->count += len;
+
+	if (used) {
+		size_t fill = SHA256_BLOCK_LEN - used;
+		if (len < fill) {
+			memcpy(ctx->buffer + used, p, len);
+			return;
+		}
+		memcpy(ctx->buffer + used, p, fill);
+		sha256_transform(ctx->state, ctx->buffer);
+		p   += fill;
+		len -= fill;
+	}
+
+	while (len >= SHA256_BLOCK_LEN) {
+		sha256_transform(ctx->state, p);
+		p   += SHA256_BLOCK_LEN;
+		len -= SHA256_BLOCK_LEN;
+	}
+
+	if (len) {
+		memcpy(ctx->buffer, p, len);
+	}
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LEN])
+{
+	uint64_t bits = ctx->count << 3;
+	size_t used = ctx->count % SHA256_BLOCK_LEN;
+	int i;
+
+	ctx->buffer[used++] = 0x80;
+	if (used > SHA256_BLOCK_LEN - 8) {
+		memset(ctx->buffer + used, 0, SHA256_BLOCK_LEN - used);
+		sha256_transform(ctx->state, ctx->buffer);
+		used = 0;
+	}
+	memset(ctx->buffer + used, 0, SHA256_BLOCK_LEN - 8 - used);
+	for (i = 0; i < 8; i++) {
+		ctx->buffer[SHA256_BLOCK_LEN - 1 - i] = (unsigned char)(bits >> (i * 8));
+	}
+	sha256_transform(ctx->state, ctx->buffer);
+
+	for (i = 0; i < 8; i++) {
+		digest[i*4]   = (unsigned char)(ctx->state[i] >> 24);
+		digest[i*4+1] = (unsigned char)(ctx->state[i] >> 16);
+		digest[i*4+2] = (unsigned char)(ctx->state[i] >> 8);
+		digest[i*4+3] = (unsigned char)(ctx->state[i]);
+	}
+}
+
+void sha256(const char *arg, int arg_len, char *sha256str)
+{
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_DIGEST_LEN];
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, arg, arg_len);
+	sha256_final(&ctx, digest);
+
+	make_digest_ex(sha256str, digest, SHA256_DIGEST_LEN);
+}
+
+
+/**
+ * precompute the ipad/opad states of a key,
+ * done once per token at config load
+ */
+void hmac_sha256_key_init(struct hmac_sha256_key *k, const void *key, size_t key_len)
+{
+	unsigned char kbuf[SHA256_BLOCK_LEN];
+	unsigned char pad[SHA256_BLOCK_LEN];
+	int i;
+
+	memset(kbuf, 0, sizeof(kbuf));
+	if (key_len > SHA256_BLOCK_LEN) {
+		struct sha256_ctx ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, key_len);
+		sha256_final(&ctx, kbuf);
+	} else {
+		memcpy(kbuf, key, key_len);
+	}
+
+	for (i = 0; i < SHA256_BLOCK_LEN; i++) pad[i] = kbuf[i] ^ 0x36;
+	sha256_init(&k->inner);
+	sha256_update(&k->inner, pad, SHA256_BLOCK_LEN);
+
+	for (i = 0; i < SHA256_BLOCK_LEN; i++) pad[i] = kbuf[i] ^ 0x5c;
+	sha256_init(&k->outer);
+	sha256_update(&k->outer, pad, SHA256_BLOCK_LEN);
+
+	memset(kbuf, 0, sizeof(kbuf));
+}
+
+void hmac_sha256(const struct hmac_sha256_key *k, const void *msg, size_t msg_len,
+		unsigned char digest[SHA256_DIGEST_LEN])
+{
+	struct sha256_ctx ctx;
+	unsigned char ihash[SHA256_DIGEST_LEN];
+
+	ctx = k->inner;
+	sha256_update(&ctx, msg, msg_len);
+	sha256_final(&ctx, ihash);
+
+	ctx = k->outer;
+	sha256_update(&ctx, ihash, SHA256_DIGEST_LEN);
+	sha256_final(&ctx, digest);
+}
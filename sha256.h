@@ -0,0 +1,67 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_BLOCK_LEN  64
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;                        /* bytes hashed so far */
+	unsigned char buffer[SHA256_BLOCK_LEN];
+};
+
+/*
+ * HMAC-SHA256 key schedule.
+ * inner/outer are the contexts after absorbing (key ^ ipad) and
+ * (key ^ opad), so a keyed hash only costs the message blocks plus
+ * one final block on each side.
+ */
+struct hmac_sha256_key {
+	struct sha256_ctx inner;
+	struct sha256_ctx outer;
+};
+
+void sha256_init  (struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final (struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LEN]);
+
+/* hex digest, sha256str MUST hold 65 bytes */
+void sha256(const char *arg, int arg_len, char *sha256str);
+
+void hmac_sha256_key_init(struct hmac_sha256_key *k, const void *key, size_t key_len);
+void hmac_sha256(const struct hmac_sha256_key *k, const void *msg, size_t msg_len,
+		unsigned char digest[SHA256_DIGEST_LEN]);
+
+#endif
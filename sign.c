@@ -0,0 +1,330 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sign.h"
+#include "util.h"
+#include "md5.h"
+#include "sha1.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* longest key of trk_id, data, date and salt we bother caching */
+#define SIGN_CACHE_KEY_LEN 160
+
+struct sign_cache_entry {
+	uint64_t hash;
+	unsigned int gen;   /* 0 for empty */
+	int op;
+	unsigned short key_len;
+	char key[SIGN_CACHE_KEY_LEN];
+};
+
+struct sign_cache {
+	size_t mask;
+	struct sign_cache_entry *entries;
+	/* written by the owner only, summed by sign_cache_stats() */
+	unsigned long long hits;
+	unsigned long long misses;
+	struct sign_cache *next;
+};
+
+static int hex_decode(const char *hex, unsigned char *bin, size_t bin_len);
+static int sign_cache_key(char *key, const char *const *fields, int n);
+static struct sign_cache_entry *sign_cache_slot(int op, const char *key,
+		int key_len, uint64_t *hash);
+
+/* no locks: every thread owns its cache, only the generation is shared */
+static __thread struct sign_cache *t_cache = NULL;
+static size_t g_cache_size = 0;
+static unsigned int g_cache_gen = 1;
+
+/* every thread's cache, for the stats; caches live as long as the process */
+static struct sign_cache *g_caches = NULL;
+static pthread_mutex_t g_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void sign_cache_init(size_t size)
+{
+	size_t n = 1;
+	if (size == 0) {
+		g_cache_size = 0;
+		return;
+	}
+	while (n < size) { n <<= 1; }
+	g_cache_size = n;
+}
+
+void sign_cache_invalidate()
+{
+	__sync_fetch_and_add(&g_cache_gen, 1);
+}
+
+void sign_cache_stats(unsigned long long *hits, unsigned long long *misses)
+{
+	struct sign_cache *c;
+
+	*hits = *misses = 0;
+	pthread_mutex_lock(&g_caches_lock);
+	for (c = g_caches; c; c = c->next) {
+		*hits   += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+		*misses += __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&g_caches_lock);
+}
+
+
+int sign_verify(const struct func *f, const struct token_item *token, int op,
+		const char *trk_id, const char *data, const char *date,
+		const char *salt)
+{
+	size_t salt_len = strlen(salt);
+	if (!sign_salt_len_ok(f, salt_len)) {
+		return TRACKD_ERR;
+	}
+
+	char key[SIGN_CACHE_KEY_LEN];
+	const char *fields[4] = {trk_id, data, date, salt};
+	int key_len = sign_cache_key(key, fields, 4);
+	uint64_t hash = 0;
+	unsigned int gen = g_cache_gen;
+	struct sign_cache_entry *e = NULL;
+
+	if (key_len > 0) {
+		e = sign_cache_slot(op, key, key_len, &hash);
+	}
+	if (e && e->gen == gen && e->hash == hash && e->op == op &&
+			e->key_len == key_len && memcmp(e->key, key, key_len) == 0) {
+		__atomic_store_n(&t_cache->hits, t_cache->hits + 1, __ATOMIC_RELAXED);
+		return TRACKD_OK;
+	}
+	if (e) {
+		__atomic_store_n(&t_cache->misses, t_cache->misses + 1, __ATOMIC_RELAXED);
+	}
+
+	int ret;
+	if (salt_len == SIGN_V2_LEN) {
+		ret = sign_verify_v2(token ? token->hkey : NULL, op,
+				trk_id, data, date, salt);
+	} else {
+		/* v1 signs it as a long long: digits only, no clamping */
+		char *end;
+		unsigned long long id;
+		errno = 0;
+		id = strtoull(trk_id, &end, 10);
+		if (*trk_id < '0' || *trk_id > '9' || *end != '\0' ||
+				errno == ERANGE || id > LLONG_MAX) {
+			ret = TRACKD_ERR;
+		} else {
+			ret = sign_verify_v1(token ? token->token : NULL,
+					(long long)id, atoi(data), atoi(date), salt);
+		}
+	}
+
+	/* only remember good ones, bad salts are not worth the slot */
+	if (ret == TRACKD_OK && e) {
+		e->hash    = hash;
+		e->gen     = gen;
+		e->op      = op;
+		e->key_len = key_len;
+		memcpy(e->key, key, key_len);
+	}
+	return ret;
+}
+
+/**
+ * the fields, each a length byte and its bytes, into key: unlike a
+ * separator, no field's content can make two tuples share a key
+ * @return bytes of it, -1 if it does not fit SIGN_CACHE_KEY_LEN
+ */
+static int sign_cache_key(char *key, const char *const *fields, int n)
+{
+	int len = 0, i;
+
+	for (i = 0; i < n; i++) {
+		size_t l = strlen(fields[i]);
+		if (l > 255 || len + 1 + l > SIGN_CACHE_KEY_LEN) {
+			return -1;
+		}
+		key[len++] = (char)l;
+		memcpy(key + len, fields[i], l);
+		len += l;
+	}
+	return len;
+}
+
+/**
+ * find the cache slot of a tuple, allocate this thread's cache on first use
+ * @return NULL if the cache is disabled
+ */
+static struct sign_cache_entry *sign_cache_slot(int op, const char *key,
+		int key_len, uint64_t *hash)
+{
+	if (g_cache_size == 0) {
+		return NULL;
+	}
+
+	if (t_cache == NULL) {
+		struct sign_cache *c = calloc(1, sizeof(struct sign_cache));
+		if (!c) return NULL;
+		c->entries = calloc(g_cache_size, sizeof(struct sign_cache_entry));
+		if (!c->entries) {
+			free(c);
+			return NULL;
+		}
+		c->mask = g_cache_size - 1;
+		t_cache = c;
+
+		pthread_mutex_lock(&g_caches_lock);
+		c->next  = g_caches;
+		g_caches = c;
+		pthread_mutex_unlock(&g_caches_lock);
+	}
+
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ULL ^ (uint64_t)op;
+	int i;
+	for (i = 0; i < key_len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	*hash = h;
+	return t_cache->entries + (h & t_cache->mask);
+}
+
+
+int sign_salt_len_ok(const struct func *f, size_t salt_len)
+{
+	if (salt_len == SIGN_V1_LEN) {
+		return 1;
+	}
+	return f != NULL && f->sign_v2 && salt_len == SIGN_V2_LEN;
+}
+
+
+/**
+ * legacy scheme, kept for old clients
+ */
+int sign_verify_v1(const char *token, long long trk_id, int data, int date,
+		const char *salt)
+{
+	if (token == NULL) {
+		return TRACKD_ERR;
+	}
+
+	struct dict d[3]; 
+	d[0].p = "trk_id";
+	d[0].v = trk_id;
+
+	d[1].p = "data";
+	d[1].v = data;
+
+	d[2].p = "date";
+	d[2].v = date;
+
+	qsort(d,3,sizeof(struct dict),cmp);
+
+	int written;
+	char buf[TRK_MAX_MSG_LEN];
+	char cryptstr[41];
+
+	written = snprintf(buf, sizeof(buf), "%s=%lld&%s=%lld&%s=%lld",
+			d[0].p,d[0].v,d[1].p,d[1].v,d[2].p,d[2].v);
+	md5(buf,written,cryptstr);
+
+	written = snprintf(buf, sizeof(buf), "%s%s", cryptstr, token);
+	sha1(buf,written,cryptstr);
+
+	if (memcmp(cryptstr,salt,SHA1_LEN) != 0) {
+		return TRACKD_ERR;
+	}
+	return TRACKD_OK;
+}
+
+
+/**
+ * keyed scheme, the ipad/opad states of the token are precomputed,
+ * so this is one short hmac plus a binary compare
+ */
+int sign_verify_v2(const struct hmac_sha256_key *key, int op,
+		const char *trk_id, const char *data, const char *date,
+		const char *salt)
+{
+	if (key == NULL) {
+		return TRACKD_ERR;
+	}
+
+	unsigned char expect[SHA256_DIGEST_LEN];
+	unsigned char digest[SHA256_DIGEST_LEN];
+	if (hex_decode(salt, expect, sizeof(expect)) != TRACKD_OK) {
+		return TRACKD_ERR;
+	}
+
+	char buf[TRK_MAX_MSG_LEN];
+	int written = snprintf(buf, sizeof(buf), "op=%d&trk_id=%s&data=%s&date=%s",
+			op, trk_id, data, date);
+	if (written < 0 || written >= sizeof(buf)) {
+		return TRACKD_ERR;
+	}
+	hmac_sha256(key, buf, written, digest);
+
+	/* constant time compare */
+	unsigned char diff = 0;
+	int i;
+	for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+		diff |= digest[i] ^ expect[i];
+	}
+	return diff == 0 ? TRACKD_OK : TRACKD_ERR;
+}
+
+
+static int hex_decode(const char *hex, unsigned char *bin, size_t bin_len)
+{
+	size_t i;
+	int hi = 0, lo;
+	for (i = 0; i < bin_len * 2; i++) {
+		char c = hex[i];
+		if (c >= '0' && c <= '9')      lo = c - '0';
+		else if (c >= 'a' && c <= 'f') lo = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') lo = c - 'A' + 10;
+		else return TRACKD_ERR;
+
+		if (i & 1) {
+			bin[i / 2] = (unsigned char)((hi << 4) | lo);
+		} else {
+			hi = lo;
+		}
+	}
+	return TRACKD_OK;
+}
@@ -0,0 +1,82 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SIGN_H__
+#define __SIGN_H__
+
+#include "trackd.h"
+#include "sha256.h"
+#include "tokenstore.h"
+
+#include <stddef.h>
+
+/*
+ * salt schemes
+ *
+ * v1: sha1(md5hex(sorted "trk_id=..&data=..&date=..") + token), 40 hex
+ * v2: hex(hmac_sha256(token, "op=..&trk_id=..&data=..&date=..")), 64 hex
+ *
+ * v2 is opt-in per op ("sign_v2 = yes" in [op_func_N_option]),
+ * v1 salts are always accepted so old clients keep working.
+ */
+#define SIGN_V1_LEN SHA1_LEN
+#define SIGN_V2_LEN (SHA256_DIGEST_LEN * 2)
+
+/* default entries of the per-thread verification cache */
+#define SIGN_CACHE_SIZE 4096
+
+int sign_salt_len_ok(const struct func *f, size_t salt_len);
+
+/**
+ * verify salt of a request, v1 or v2 is chosen by the salt length.
+ * Tuples verified recently on this thread are answered from the cache.
+ */
+int sign_verify(const struct func *f, const struct token_item *token, int op,
+		const char *trk_id, const char *data, const char *date,
+		const char *salt);
+
+/*
+ * bounded, per-thread, direct-mapped cache of verified
+ * (op, trk_id, data, date, salt) tuples.
+ * size 0 disables the cache.
+ * sign_cache_invalidate() MUST be called whenever tokens change.
+ */
+void sign_cache_init(size_t size);
+void sign_cache_invalidate();
+
+/* hits and misses of all threads' caches since start */
+void sign_cache_stats(unsigned long long *hits, unsigned long long *misses);
+
+int sign_verify_v1(const char *token, long long trk_id, int data, int date,
+		const char *salt);
+int sign_verify_v2(const struct hmac_sha256_key *key, int op,
+		const char *trk_id, const char *data, const char *date,
+		const char *salt);
+
+#endif
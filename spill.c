@@ -0,0 +1,420 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "spill.h"
+#include "trackd.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+struct spill_rec {
+	uint32_t len;
+	uint32_t raw_len;
+};
+
+#define SPILL_REC_HDR   sizeof(struct spill_rec)
+#define SPILL_ALIGN(n)  (((n) + 7) & ~(size_t)7)
+#define SPILL_ZBUF_LEN  4096
+
+
+static void spill_path(struct spill *s, uint64_t seq, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/spill-%d-%016llx.seg",
+			s->dir, s->worker, (unsigned long long)seq);
+}
+
+
+/**
+ * next record of a mapped segment
+ * @return its header, NULL at the end of the segment
+ */
+static const struct spill_rec *spill_next_rec(const struct spill_segment *seg)
+{
+	const struct spill_rec *hdr;
+
+	if (seg->off + SPILL_REC_HDR > seg->size) {
+		return NULL;
+	}
+	hdr = (const struct spill_rec *)(seg->base + seg->off);
+	if (hdr->len == 0 || hdr->len > seg->size - seg->off - SPILL_REC_HDR) {
+		return NULL;  /* end, or a torn record */
+	}
+	return hdr;
+}
+
+
+/* map a sealed segment for reading, empty segments are removed */
+static int spill_segment_open(struct spill *s, uint64_t seq, struct spill_segment *seg)
+{
+	char path[512];
+	struct stat st;
+
+	spill_path(s, seq, path, sizeof(path));
+	seg->fd = open(path, O_RDONLY);
+	if (seg->fd == -1) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "open spill segment %s failure: %s\n", path, strerror(errno));
+		}
+		return TRACKD_ERR;
+	}
+	if (fstat(seg->fd, &st) != 0 || st.st_size == 0) {
+		close(seg->fd);
+		unlink(path);
+		return TRACKD_ERR;
+	}
+
+	seg->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+	if (seg->base == MAP_FAILED) {
+		fprintf(stderr, "mmap spill segment %s failure: %s\n", path, strerror(errno));
+		seg->base = NULL;
+		close(seg->fd);
+		return TRACKD_ERR;
+	}
+	madvise(seg->base, st.st_size, MADV_SEQUENTIAL);
+
+	seg->seq  = seq;
+	seg->size = st.st_size;
+	seg->off  = 0;
+	return TRACKD_OK;
+}
+
+
+/* unmap and remove the segment being read, under rlock */
+static void spill_segment_drop(struct spill *s)
+{
+	char path[512];
+
+	spill_path(s, s->r.seq, path, sizeof(path));
+	munmap(s->r.base, s->r.size);
+	close(s->r.fd);
+	unlink(path);
+	s->r.base = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	s->used_bytes -= s->r.size < s->used_bytes ? s->r.size : s->used_bytes;
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+/* create the next segment for writing */
+static int spill_segment_create(struct spill *s)
+{
+	char path[512];
+
+	spill_path(s, s->write_seq, path, sizeof(path));
+	s->w.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (s->w.fd == -1) {
+		fprintf(stderr, "create spill segment %s failure: %s\n", path, strerror(errno));
+		return TRACKD_ERR;
+	}
+	if (ftruncate(s->w.fd, s->segment_bytes) != 0) {
+		close(s->w.fd);
+		unlink(path);
+		return TRACKD_ERR;
+	}
+
+	s->w.base = mmap(NULL, s->segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, s->w.fd, 0);
+	if (s->w.base == MAP_FAILED) {
+		s->w.base = NULL;
+		close(s->w.fd);
+		unlink(path);
+		return TRACKD_ERR;
+	}
+
+	s->w.seq  = s->write_seq++;
+	s->w.size = s->segment_bytes;
+	s->w.off  = 0;
+	return TRACKD_OK;
+}
+
+
+/* seal a written segment, the file is cut to its used size */
+static void spill_segment_seal(struct spill_segment *seg)
+{
+	munmap(seg->base, seg->size);
+	if (ftruncate(seg->fd, seg->off) != 0) {
+		fprintf(stderr, "truncate spill segment failure: %s\n", strerror(errno));
+	}
+	close(seg->fd);
+	seg->base = NULL;
+}
+
+
+static int cmp_seq(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* pick up the segments of a previous run */
+static int spill_recover(struct spill *s)
+{
+	DIR *d;
+	struct dirent *de;
+	uint64_t *seqs = NULL;
+	size_t n = 0, cap = 0, i;
+
+	d = opendir(s->dir);
+	if (d == NULL) {
+		fprintf(stderr, "open spill_dir %s failure: %s\n", s->dir, strerror(errno));
+		return TRACKD_ERR;
+	}
+	while ((de = readdir(d)) != NULL) {
+		int worker;
+		unsigned long long seq;
+		char end;
+
+		if (sscanf(de->d_name, "spill-%d-%llx.se%c", &worker, &seq, &end) != 3 ||
+				end != 'g' || worker != s->worker) {
+			continue;
+		}
+		if (n == cap) {
+			uint64_t *p = realloc(seqs, (cap = cap ? cap * 2 : 16) * sizeof(uint64_t));
+			if (!p) {
+				free(seqs);
+				closedir(d);
+				return TRACKD_ERR;
+			}
+			seqs = p;
+		}
+		seqs[n++] = seq;
+	}
+	closedir(d);
+
+	if (n == 0) {
+		return TRACKD_OK;
+	}
+	qsort(seqs, n, sizeof(uint64_t), cmp_seq);
+	s->read_seq  = seqs[0];
+	s->write_seq = seqs[n - 1] + 1;
+
+	for (i = 0; i < n; i++) {
+		struct spill_segment seg;
+		if (spill_segment_open(s, seqs[i], &seg) != TRACKD_OK) {
+			continue;
+		}
+		while (spill_next_rec(&seg)) {
+			const struct spill_rec *hdr = (const struct spill_rec *)(seg.base + seg.off);
+			seg.off += SPILL_REC_HDR + SPILL_ALIGN(hdr->len);
+			s->records++;
+		}
+		s->used_bytes += seg.size;
+		munmap(seg.base, seg.size);
+		close(seg.fd);
+	}
+	free(seqs);
+	return TRACKD_OK;
+}
+
+
+struct spill *spill_new(const char *dir, int worker, size_t max_bytes,
+		size_t segment_bytes, int compress)
+{
+	struct spill *s = calloc(1, sizeof(struct spill));
+	if (!s) {
+		return NULL;
+	}
+
+#ifndef HAVE_LZ4
+	if (compress == SPILL_COMPRESS_LZ4) {
+		fprintf(stderr, "built without lz4, spill segments are not compressed\n");
+		compress = SPILL_COMPRESS_NONE;
+	}
+#endif
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_mutex_init(&s->rlock, NULL);
+	s->dir           = strdup(dir);
+	s->worker        = worker;
+	s->compress      = compress;
+	s->max_bytes     = max_bytes;
+	s->segment_bytes = SPILL_ALIGN(segment_bytes);
+
+	if (!s->dir || spill_recover(s) != TRACKD_OK) {
+		spill_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+/**
+ * segments are kept on disk, they are replayed by the next run
+ */
+void spill_free(struct spill *s)
+{
+	assert(s);
+	if (s->w.base) {
+		spill_segment_seal(&s->w);
+	}
+	if (s->r.base) {
+		munmap(s->r.base, s->r.size);
+		close(s->r.fd);
+	}
+	pthread_mutex_destroy(&s->lock);
+	pthread_mutex_destroy(&s->rlock);
+	free(s->dir);
+	free(s);
+}
+
+
+int spill_append(struct spill *s, const void *rec, size_t len)
+{
+	struct spill_rec hdr;
+	const void *payload = rec;
+#ifdef HAVE_LZ4
+	char zbuf[SPILL_ZBUF_LEN];
+
+	if (s->compress == SPILL_COMPRESS_LZ4 && (size_t)LZ4_compressBound(len) <= sizeof(zbuf)) {
+		int zlen = LZ4_compress_default(rec, zbuf, len, sizeof(zbuf));
+		if (zlen > 0 && (size_t)zlen < len) {
+			payload = zbuf;
+			hdr.len = zlen;
+		}
+	}
+#endif
+	if (len == 0 || len > UINT32_MAX) {
+		return TRACKD_ERR;
+	}
+	hdr.raw_len = len;
+	if (payload == rec) {
+		hdr.len = len;
+	}
+
+	size_t need = SPILL_REC_HDR + SPILL_ALIGN(hdr.len);
+	if (need > s->segment_bytes) {
+		return TRACKD_ERR;
+	}
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->used_bytes + need > s->max_bytes) {
+		pthread_mutex_unlock(&s->lock);
+		return TRACKD_ERR;
+	}
+	if (s->w.base && s->w.off + need > s->w.size) {
+		spill_segment_seal(&s->w);
+	}
+	if (!s->w.base && spill_segment_create(s) != TRACKD_OK) {
+		pthread_mutex_unlock(&s->lock);
+		return TRACKD_ERR;
+	}
+
+	/* payload first, a zero header ends the segment if we crash here */
+	memcpy(s->w.base + s->w.off + SPILL_REC_HDR, payload, hdr.len);
+	memcpy(s->w.base + s->w.off, &hdr, SPILL_REC_HDR);
+	s->w.off      += need;
+	s->used_bytes += need;
+	__atomic_add_fetch(&s->records, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&s->lock);
+	return TRACKD_OK;
+}
+
+
+size_t spill_read(struct spill *s, void *recs, size_t stride, size_t max)
+{
+	const struct spill_rec *hdr;
+	char *dst = recs;
+	size_t n = 0;
+
+	pthread_mutex_lock(&s->rlock);
+
+	while (n < max) {
+		if (!s->r.base) {
+			struct spill_segment sealed = {0};
+			uint64_t write_seq;
+
+			/* caught up with the writer: take its segment, seal and read it */
+			pthread_mutex_lock(&s->lock);
+			if (s->w.base && s->read_seq == s->w.seq) {
+				sealed    = s->w;
+				s->w.base = NULL;
+			}
+			write_seq = s->write_seq;
+			pthread_mutex_unlock(&s->lock);
+
+			if (sealed.base) {
+				spill_segment_seal(&sealed);
+			}
+			if (s->read_seq == write_seq) {
+				break;
+			}
+			if (spill_segment_open(s, s->read_seq, &s->r) != TRACKD_OK) {
+				s->read_seq++;
+				continue;
+			}
+		}
+
+		hdr = spill_next_rec(&s->r);
+		if (hdr == NULL) {
+			spill_segment_drop(s);
+			s->read_seq++;
+			continue;
+		}
+
+		const char *payload = s->r.base + s->r.off + SPILL_REC_HDR;
+		char *out = dst + n * stride;
+		int ok = 0;
+
+		if (hdr->len == hdr->raw_len && hdr->len <= stride) {
+			memcpy(out, payload, hdr->len);
+			ok = 1;
+		}
+#ifdef HAVE_LZ4
+		else if (hdr->raw_len <= stride) {
+			ok = LZ4_decompress_safe(payload, out, hdr->len, stride) == (int)hdr->raw_len;
+		}
+#endif
+		s->r.off += SPILL_REC_HDR + SPILL_ALIGN(hdr->len);
+		if (s->records > 0) {
+			__atomic_sub_fetch(&s->records, 1, __ATOMIC_RELAXED);
+		}
+		if (ok) {
+			n++;
+		} else {
+			__atomic_add_fetch(&s->bad, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_unlock(&s->rlock);
+	return n;
+}
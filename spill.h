@@ -0,0 +1,123 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ -------------------------------------------------------------------------------
+ overflow spill
+ -------------------------------------------------------------------------------
+ When a worker's pool is full, events go to the worker's spill instead:
+ append-only segment files in spill_dir, named
+
+   spill-<worker>-<seq>.seg
+
+ each mmap'd while it is written. A record is
+
+   uint32 len, uint32 raw_len, payload[len]   8-byte aligned
+
+ raw_len != len when the payload is lz4 compressed; a zero len ends a
+ segment. Segments are replayed in order once the worker's pool drained,
+ and unlinked when read; segments left by a previous run are replayed
+ first, a partly replayed one in full again. Events in the pool and in
+ the spill are not ordered with each other.
+*/
+
+#define SPILL_COMPRESS_NONE 0
+#define SPILL_COMPRESS_LZ4  1
+
+struct spill_segment {
+	uint64_t seq;
+	int      fd;
+	char    *base;
+	size_t   size;     /* mapped size */
+	size_t   off;      /* write or read offset */
+};
+
+struct spill {
+	pthread_mutex_t lock;     /* the writer's side: w, write_seq, used_bytes */
+	pthread_mutex_t rlock;    /* the reader's side: r, read_seq */
+
+	char    *dir;
+	int      worker;
+	int      compress;
+	size_t   segment_bytes;
+	size_t   max_bytes;   /* disk budget of this spill */
+	size_t   used_bytes;  /* bytes in segments not unlinked yet */
+
+	uint64_t read_seq;    /* oldest segment */
+	uint64_t write_seq;   /* next segment to create */
+
+	struct spill_segment w;  /* segment being written, base NULL if none */
+	struct spill_segment r;  /* sealed segment being read, base NULL if none */
+
+	uint64_t records;     /* records not replayed yet */
+	uint64_t bad;         /* records read that could not be decoded */
+};
+
+/**
+ * open the spill of a worker, segments of a previous run are kept
+ * @return NULL on failure
+ */
+struct spill *spill_new(const char *dir, int worker, size_t max_bytes,
+		size_t segment_bytes, int compress);
+void spill_free(struct spill *s);
+
+/**
+ * append a record, thread safe
+ * @return TRACKD_OK, TRACKD_ERR if over budget or on io errors
+ */
+int spill_append(struct spill *s, const void *rec, size_t len);
+
+/**
+ * read up to max records in order, the i-th into recs + i * stride;
+ * a record that can't be decoded into stride bytes is skipped, see
+ * spill_take_bad(). Files are only touched under the reader's lock
+ * @return number of records read, 0 if empty
+ */
+size_t spill_read(struct spill *s, void *recs, size_t stride, size_t max);
+
+/* records waiting for replay, approximate */
+static inline uint64_t spill_pending(struct spill *s)
+{
+	return __atomic_load_n(&s->records, __ATOMIC_RELAXED);
+}
+
+/* records skipped by spill_read() since the last call */
+static inline uint64_t spill_take_bad(struct spill *s)
+{
+	return __atomic_exchange_n(&s->bad, 0, __ATOMIC_RELAXED);
+}
+
+#endif
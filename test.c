@@ -30,6 +30,12 @@
 
 #include "md5.h"
 #include "sha1.h"
+#include "sha256.h"
+#include "tokenstore.h"
+#include "pool.h"
+#include "agg.h"
+#include "coalesce.h"
+#include "resp.h"
 #include "trackd.h"
 #include "mysqljob.h"
 
@@ -39,7 +45,7 @@
 
 void testMySQL(){
 	MYSQL my_connection;
-	MYSQL_RES *result;
+	MYSQL_RES *result = NULL;
 	MYSQL_ROW sql_row;
 	MYSQL_FIELD *fd;
 	char column[MAX_COLUMN_LEN][MAX_COLUMN_LEN];
@@ -92,7 +98,8 @@ void testMySQL(){
 	mysql_library_end();
 }
 
-int main(){
+//the unit tests run alone, "./test mysql" also needs the dashboard server
+int main(int argc, char *argv[]){
 	//test md5
 	char md5str[33];
 	char *p = "test";
@@ -106,6 +113,128 @@ int main(){
 	sha1(q,strlen(q),sha1str);
 	assert(memcmp(sha1str,"d0be2dc421be4fcd0172e5afceea3970e2f3d940",40) == 0);
 
-	testMySQL();
+	//test sha256
+	char sha256str[65];
+	sha256(q,strlen(q),sha256str);
+	assert(memcmp(sha256str,"3a7bd3e2360a3d29eea436fcfb7e44c735d117c42d1c1835420b6b9942dd4f1b",64) == 0);
+
+	//test hmac-sha256, RFC 4231 test case 2
+	struct hmac_sha256_key hkey;
+	unsigned char digest[SHA256_DIGEST_LEN];
+	char hmacstr[65];
+	const char *msg = "what do ya want for nothing?";
+	hmac_sha256_key_init(&hkey,"Jefe",4);
+	hmac_sha256(&hkey,msg,strlen(msg),digest);
+	make_digest_ex(hmacstr,digest,SHA256_DIGEST_LEN);
+	assert(memcmp(hmacstr,"5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843",64) == 0);
+
+	//test token store
+	struct token_entry entries[] = {{1,"xxx"},{2,"token2"},{1,"dup"}};
+	struct token_store *store = token_store_new(entries,3,1);
+	struct token_item token;
+	assert(store && token_store_count(store) == 2);
+	assert(token_store_get(store,1,&token) == 0 && strcmp(token.token,"xxx") == 0);
+	assert(token_store_get(store,2,&token) == 0 && token.hkey != NULL);
+	assert(token_store_get(store,3,&token) != 0);
+	token_store_free(store);
+
+	//test pool, variable-length records wrapping the ring
+	struct pool *pl = pool_new(256,64,0);
+	struct trk_item in, out;
+	int i;
+	assert(pl && pl->capacity == 4 && pool_pop(pl,&out,sizeof(out)) == -1);
+	memset(&in,0,sizeof(in));
+	for(i=0;i<10;i++){
+		in.trk_id = i;
+		memset(in.query_str,'a'+i,130+i);
+		assert(pool_push(pl,&in,trk_item_len(&in)) == 0);
+		assert(pool_push(pl,&in,trk_item_len(&in)) == -2);
+		assert(pool_pop(pl,&out,sizeof(out)) == (int)trk_item_len(&in));
+		assert(out.trk_id == i && strcmp(out.query_str,in.query_str) == 0);
+	}
+	assert(pool_size(pl) == 0);
+	//a thief done before the owner: the owner's cells are still busy
+	char rawbuf[200] = {0};
+	assert(pool_push(pl,rawbuf,100) == 0 && pool_push(pl,rawbuf,100) == 0);
+	uint64_t busy = pl->tail;
+	assert(pool_pop(pl,rawbuf,sizeof(rawbuf)) == 100 && pool_pop(pl,rawbuf,sizeof(rawbuf)) == 100);
+	pl->seqs[busy & pl->mask] = busy + 1;
+	assert(pool_push(pl,rawbuf,200) == -2);
+	pl->seqs[busy & pl->mask] = busy + pl->capacity;
+	assert(pool_push(pl,rawbuf,200) == 0 && pool_pop(pl,rawbuf,sizeof(rawbuf)) == 200);
+	pool_free(pl);
+
+	//test agg, folding and a flush put back
+	struct agg *ag = agg_new(16);
+	struct agg_entry *ae;
+	size_t an;
+	assert(ag && agg_add(ag,"k","f",AGG_SUM,3) == 0 && agg_add(ag,"k","f",AGG_SUM,4) == 0);
+	assert(agg_add(ag,"k","c",AGG_COUNT,9) == 0 && agg_add(ag,"k","c",AGG_COUNT,9) == 0);
+	assert(agg_add(ag,"k","m",AGG_MAX,5) == 0 && agg_add(ag,"k","m",AGG_MAX,2) == 0);
+	ae = agg_take(ag,&an);
+	assert(an == 3 && ag->used == 0);
+	for(i=0;i<(int)an;i++){
+		assert(ae[i].value == (ae[i].field[0] == 'f' ? 7 : ae[i].field[0] == 'c' ? 2 : 5));
+		assert(agg_put_back(ag,ae+i) == 0);
+	}
+	assert(agg_add(ag,"k","c",AGG_COUNT,0) == 0 && ag->used == 3);
+	//a put back last value does not replace a newer one
+	ae = agg_take(ag,&an);
+	assert(agg_add(ag,"k","l",AGG_LAST,1) == 0);
+	ae = agg_take(ag,&an);
+	assert(an == 1 && agg_add(ag,"k","l",AGG_LAST,2) == 0 && agg_put_back(ag,ae) == 0);
+	ae = agg_take(ag,&an);
+	assert(an == 1 && ae[0].value == 2 && agg_put_back(ag,ae) == 0);
+	ae = agg_take(ag,&an);
+	assert(an == 1 && ae[0].value == 2);
+	agg_free(ag);
+
+	//test coalesce, the last item of a (trk_id, date) wins
+	struct coalesce *co = coalesce_new(2,"date");
+	struct trk_item *ci;
+	size_t cn;
+	memset(&in,0,sizeof(in));
+	in.trk_id = 1;
+	strcpy(in.query_str,"date=20131203&data=1");
+	assert(co && coalesce_put(co,&in) == 0);
+	strcpy(in.query_str,"date=20131203&data=2");
+	assert(coalesce_put(co,&in) == 0);
+	in.trk_id = 2;
+	assert(coalesce_put(co,&in) == 1 && coalesce_put(co,&in) == 1);
+	in.trk_id = 3;
+	assert(coalesce_put(co,&in) == -1);
+	ci = coalesce_items(co,&cn);
+	assert(cn == 2 && ci[0].trk_id == 1 && strcmp(ci[0].query_str,"date=20131203&data=2") == 0);
+	coalesce_clear(co);
+	assert(coalesce_put(co,&in) == 0);
+	coalesce_free(co);
+
+	//test resp, a command and the replies the sinks get back
+	struct resp_buf rb = {0};
+	struct resp_reply rr;
+	const char *rs = ":-12\r\n-NOSCRIPT x\r\n$3\r\nabc\r\n$-1\r\n:1";
+	assert(resp_begin(&rb,4) == 0 && resp_arg_str(&rb,"HSET") == 0 && resp_arg_str(&rb,"k") == 0);
+	assert(resp_arg(&rb,"f",1) == 0 && resp_arg_ll(&rb,-42) == 0);
+	assert(rb.len == 37 && memcmp(rb.data,"*4\r\n$4\r\nHSET\r\n$1\r\nk\r\n$1\r\nf\r\n$3\r\n-42\r\n",37) == 0);
+	resp_buf_free(&rb);
+	assert(resp_parse(rs,strlen(rs),&rr) == 6 && rr.type == RESP_INTEGER && rr.integer == -12);
+	rs += 6;
+	assert(resp_parse(rs,strlen(rs),&rr) == 13 && rr.type == RESP_ERROR && rr.len == 10);
+	rs += 13;
+	assert(resp_parse(rs,strlen(rs),&rr) == 9 && rr.type == RESP_BULK && memcmp(rr.str,"abc",3) == 0);
+	rs += 9;
+	assert(resp_parse(rs,strlen(rs),&rr) == 5 && rr.type == RESP_BULK && rr.str == NULL);
+	rs += 5;
+	assert(resp_parse(rs,strlen(rs),&rr) == 0 && resp_parse(":x\r\n",4,&rr) == -1);
+
+	//test mysql_table and mysql_columns, they go into the statements
+	assert(mysql_sql_names("T_Zhixin_Stat") == 1 && mysql_sql_names("db.t$1") == 1);
+	assert(mysql_sql_names("trk_id,date,data,time") == 4);
+	assert(mysql_sql_names("") == -1 && mysql_sql_names("a,") == -1 && mysql_sql_names(",a") == -1);
+	assert(mysql_sql_names("a,,b") == -1 && mysql_sql_names("t values(1);--") == -1);
+
+	if(argc > 1 && strcmp(argv[1],"mysql") == 0){
+		testMySQL();
+	}
 	return 0;
 }
@@ -28,27 +28,64 @@
  */
 
 #include "pool.h"
+#include "spill.h"
+#include "wal.h"
+#include "route.h"
+#include "topology.h"
 #include "thread.h"
 #include "redisjob.h"
 #include "mysqljob.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 extern struct settings *g_settings;
+extern struct running  *g_running;
 
-static void create_worker(void *(*func)(void *), void *arg);
+static pthread_t create_worker(void *(*func)(void *), void *arg);
 static void *worker_libevent_loop(void *arg);
 
 static void libevent_cb_worker_notify(int fd, short which, void *arg);
-
-static void trk_thread_setup_sink_client(struct trk_thread *me);
-static void setup_client_node(struct trk_client_node *n,struct func *f,char *host,char *port);
+static void trk_thread_wakeup(struct trk_thread *me);
+static void trk_thread_busypoll(struct trk_thread *me);
+static void trk_thread_process(struct trk_thread *me, struct trk_item *trk_item);
+static void trk_thread_process_run(struct trk_thread *me, struct trk_item *items, size_t n);
+static struct trk_client_node *next_client_node(struct func *f, struct trk_sink_client *client);
+static void trk_thread_agg_flush(struct trk_sink_client *client);
+static void trk_thread_coalesce_flush(struct trk_sink_client *client);
+static void libevent_cb_client_flush(int fd, short which, void *arg);
+static void trk_thread_write_run(struct trk_thread *me, struct func *f,
+		struct trk_sink_client *client, struct trk_item *items, size_t n);
+static void trk_thread_process_batch(struct trk_thread *me, size_t n, struct trk_thread *from);
+static int trk_thread_putback(struct trk_thread *me, struct func *f, struct trk_item *item);
+static void trk_thread_drain(struct trk_thread *me);
+static void libevent_cb_worker_steal(int fd, short which, void *arg);
+static void *wal_sync_loop(void *arg);
+static void *route_rebalance_loop(void *arg);
+static void *autoscale_loop(void *arg);
+static int trk_thread_spawn(struct trk_thread *me);
+static int trk_thread_start(struct trk_thread *me);
+static void trk_thread_retire(struct trk_thread *me);
+static void libevent_cb_worker_retire(int fd, short which, void *arg);
+static void trk_thread_work(struct trk_thread *me);
+
+static int trk_thread_setup_sink_client(struct trk_thread *me);
+static void trk_thread_close_sink_client(struct trk_thread *me);
+static int setup_client_node(struct trk_client_node *n,struct func *f,char *host,char *port,
+		struct event_base *base);
+static int trk_thread_sink_full(struct trk_thread *me, int op);
+static int trk_thread_inflight(struct trk_thread *me);
+static int trk_thread_backlog(struct trk_thread *me);
 /*
  * Number of worker threads that have finished setting themselves up.
  */
@@ -62,19 +99,56 @@ static pthread_cond_t init_cond;
  */
 static struct trk_thread *threads;
 
+/*
+ * workers [0, active_workers) take events, the others are retired or
+ * not started yet, see autoscale_loop()
+ */
+static int active_workers;
+
+/*
+ * workers started by trk_thread_init()
+ */
+static int init_workers;
+
+/*
+ * held while a worker is started or retired, see autoscale_loop()
+ */
+static pthread_mutex_t scale_lock;
+
+/*
+ * set under scale_lock by trk_thread_shutdown(), the helpers leave
+ */
+static int stopping;
+static pthread_t wal_sync_tid;
+
+/*
+ * bucket owners, affinity dispatch only
+ */
+static struct route *route;
+
+/*
+ * per worker hook, see trk_thread_init()
+ */
+static trk_thread_attach_cb thread_attach;
+
+__thread struct trk_thread *trk_thread_self;
+
 
 /**
  * init track worker thread
  */
-int trk_thread_init(int trk_msg_len)
+int trk_thread_init(int trk_msg_len, trk_thread_attach_cb attach)
 {
+	thread_attach = attach;
+
 	pthread_mutex_init(&init_lock, NULL);
 	pthread_cond_init(&init_cond, NULL);
+	pthread_mutex_init(&scale_lock, NULL);
 
 	//init mysql library
 	//mysql_library_init(0, NULL, NULL);
 	//实例化nthreads个线程
-	threads = calloc(g_settings->num_worker_threads, sizeof(struct trk_thread));
+	threads = calloc(g_settings->max_worker_threads, sizeof(struct trk_thread));
 	if (!threads) {
 		fprintf(stderr, "can't allocate thread descriptors");
 		exit(1);
@@ -82,21 +156,38 @@ int trk_thread_init(int trk_msg_len)
 
 	int i;
 	struct trk_thread *me = NULL;
-	int nthreads = g_settings->num_worker_threads;
+	/* descriptors, spill and wal of every worker we may scale up to */
+	int nthreads = g_settings->max_worker_threads;
+
+	if (g_settings->dispatch == TRK_DISPATCH_AFFINITY) {
+		route = route_new(nthreads);
+		if (!route) {
+			fprintf(stderr, "can't allocate route table\n");
+			exit(1);
+		}
+	}
 	for (i = 0; i < nthreads; i++) {
 		me = &threads[i];
 
+#ifdef __linux__
+		int efd = eventfd(0, EFD_NONBLOCK);
+		if (efd == -1) {
+			fprintf(stderr, "can't create notify eventfd");
+			exit(1);
+		}
+		me->notify_receive_fd = efd;
+		me->notify_send_fd    = efd;
+#else
 		int fds[2];
 		if (pipe(fds)) {
 			fprintf(stderr, "can't create notify pipe");
 			exit(1);
 		}
-#ifdef _GNU_SOURCE
-		fcntl(fds[0], F_SETFL, O_NOATIME);
-#endif
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
 
 		me->notify_receive_fd = fds[0];
 		me->notify_send_fd    = fds[1];
+#endif
 
 		me->base = event_init();
 		if (!me->base) {
@@ -114,25 +205,98 @@ int trk_thread_init(int trk_msg_len)
 			exit(1);
 		}
 
-		/* init buffer pool */
-		me->pool = pool_new(TRK_POOL_CAPACITY, trk_msg_len);
-		if (!me->pool) {
+		/* look for stranded items of other workers while idle */
+		if (g_settings->work_stealing && nthreads > 1 &&
+				g_settings->mode == TRK_MODE_PIPELINE) {
+			struct timeval tv = {0, TRK_STEAL_INTERVAL_MS * 1000};
+			evtimer_set(&me->steal_event, libevent_cb_worker_steal, me);
+			event_base_set(me->base, &me->steal_event);
+			evtimer_add(&me->steal_event, &tv);
+		}
+
+		/* lanes, their pools are allocated by the worker itself */
+		me->lanes = calloc(g_settings->num_lanes, sizeof(struct trk_lane));
+		if (!me->lanes) {
 			fprintf(stderr, "init buffer pool failure\n");
 			exit(1);
 		}
+		me->idx = i;
+		me->batch_len = trk_msg_len;
+
+		if (g_settings->spill_dir) {
+			me->spill = spill_new(g_settings->spill_dir, i,
+					((size_t)g_settings->spill_max_mb << 20) / nthreads,
+					(size_t)g_settings->spill_segment_mb << 20,
+					g_settings->spill_compress);
+			if (!me->spill) {
+				fprintf(stderr, "init spill failure, spill_dir: %s\n",
+						g_settings->spill_dir);
+				exit(1);
+			}
+			/* left by a previous run */
+			if (spill_pending(me->spill)) {
+				trk_thread_notify(me);
+			}
+		}
+
+		if (g_settings->wal_dir) {
+			me->wal = wal_open(g_settings->wal_dir, i,
+					(size_t)g_settings->wal_segment_mb << 20);
+			if (!me->wal) {
+				fprintf(stderr, "init wal failure, wal_dir: %s\n",
+						g_settings->wal_dir);
+				exit(1);
+			}
+			/* unacked items of the previous worker process */
+			if (wal_replay_pending(me->wal)) {
+				trk_thread_notify(me);
+			}
+		}
+
+		if (route) {
+			me->route_hits = calloc(ROUTE_BUCKETS, sizeof(uint32_t));
+			if (!me->route_hits) {
+				fprintf(stderr, "can't allocate route counters\n");
+				exit(1);
+			}
+		}
+
+	}
 
-		trk_thread_setup_sink_client(me);
+	/* workers left with a backlog by the previous run start right away */
+	init_workers = g_settings->num_worker_threads;
+	for (i = init_workers; i < nthreads; i++) {
+		if (threads[i].notify_pending) {
+			init_workers = i + 1;
+		}
+	}
+
+	for (i = 0; i < init_workers; i++) {
+		if (trk_thread_setup_sink_client(&threads[i]) != TRACKD_OK) {
+			exit(1);
+		}
 	}
 
 	/* Create threads after we've done all the libevent setup. */
 	/* worker_libevent_loop will incr init_count. */
-	for (i = 0; i < nthreads; i++) {
+	active_workers = init_workers;
+	for (i = 0; i < init_workers; i++) {
+		threads[i].accepting = 1;
 		create_worker(worker_libevent_loop, &threads[i]);
 	}
+	if (g_settings->wal_dir) {
+		wal_sync_tid = create_worker(wal_sync_loop, NULL);
+	}
+	if (route && g_settings->rebalance_interval > 0) {
+		create_worker(route_rebalance_loop, NULL);
+	}
+	if (g_settings->max_worker_threads > g_settings->min_worker_threads) {
+		create_worker(autoscale_loop, NULL);
+	}
 
 	/* Wait for all the threads to set themselves up before returning. */
 	pthread_mutex_lock(&init_lock);
-	while (init_count < nthreads) {
+	while (init_count < init_workers) {
 		pthread_cond_wait(&init_cond, &init_lock);
 	}
 	pthread_mutex_unlock(&init_lock);
@@ -141,7 +305,11 @@ int trk_thread_init(int trk_msg_len)
 }
 
 
-static void trk_thread_setup_sink_client(struct trk_thread *me)
+/**
+ * connect the sink servers of every op, TRACKD_ERR if one can't be
+ * reached: what was connected is closed again
+ */
+static int trk_thread_setup_sink_client(struct trk_thread *me)
 {
 	assert(me);
 
@@ -149,7 +317,13 @@ static void trk_thread_setup_sink_client(struct trk_thread *me)
 	struct func *f = NULL;
 	struct trk_sink_client *client = NULL;
 
-	for(j=0;j<DDTRACK_OP_MAX;j++){
+	me->trk_r_clients = calloc(g_settings->num_op_funcs, sizeof(struct trk_sink_client *));
+	if(!me->trk_r_clients){
+		fprintf(stderr, "calloc trk_r_clients failed");
+		exit(-1);
+	}
+
+	for(j=0;j<g_settings->num_op_funcs;j++){
 		f = g_settings->op_funcs[j];
 		if(f == NULL) continue;
 
@@ -164,6 +338,7 @@ static void trk_thread_setup_sink_client(struct trk_thread *me)
 		}
 
 		client->op = j;
+		client->thread = me;
 
 		client->num_clients = 1;
 		while (*p) {
@@ -214,7 +389,10 @@ static void trk_thread_setup_sink_client(struct trk_thread *me)
 				port[0] = 0;
 			}
 
-			setup_client_node(client->nodes+client_idx,f,host,port);
+			if (setup_client_node(client->nodes+client_idx,f,host,port,me->base) != TRACKD_OK) {
+				trk_thread_close_sink_client(me);
+				return TRACKD_ERR;
+			}
 
 			client_idx++;
 
@@ -223,10 +401,80 @@ static void trk_thread_setup_sink_client(struct trk_thread *me)
 			}
 			ptr++;
 		}//end while
+
+		/* settings_init() checked the sink can aggregate */
+		if (f->agg_window_ms > 0) {
+			client->agg = agg_new(f->agg_slots);
+			if (!client->agg) {
+				fprintf(stderr, "calloc struct agg failed");
+				exit(-1);
+			}
+		}
+		if (f->coalesce_ms > 0) {
+			client->coalesce = coalesce_new(f->coalesce_max, f->coalesce_by);
+			if (!client->coalesce) {
+				fprintf(stderr, "calloc struct coalesce failed");
+				exit(-1);
+			}
+		}
+		if (client->agg || client->coalesce) {
+			/* first flush anywhere in the window, workers spread out */
+			int window = client->agg ? f->agg_window_ms : f->coalesce_ms;
+			client->flush_seed = (unsigned int)time(NULL) ^ (me->idx << 8) ^ j;
+			int ms = 1 + rand_r(&client->flush_seed) % window;
+			struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+			evtimer_set(&client->flush_event, libevent_cb_client_flush, client);
+			event_base_set(me->base, &client->flush_event);
+			evtimer_add(&client->flush_event, &tv);
+		}
 	}
+	return TRACKD_OK;
 }
 
-static void setup_client_node(struct trk_client_node *n,struct func *f,char *host,char *port){
+/**
+ * flush what is buffered and hang up, on the worker's own thread
+ */
+static void trk_thread_close_sink_client(struct trk_thread *me)
+{
+	int j, k;
+
+	if (!me->trk_r_clients) {
+		return;
+	}
+	for (j = 0; j < g_settings->num_op_funcs; j++) {
+		struct trk_sink_client *client = me->trk_r_clients[j];
+		if (client == NULL) {
+			continue;
+		}
+		/* what was buffered goes out while the nodes are up */
+		if (client->agg || client->coalesce) {
+			event_del(&client->flush_event);
+		}
+		if (client->agg) {
+			trk_thread_agg_flush(client);
+			agg_free(client->agg);
+		}
+		if (client->coalesce) {
+			trk_thread_coalesce_flush(client);
+			coalesce_free(client->coalesce);
+		}
+		for (k = 0; k < client->num_clients; k++) {
+			struct trk_client_node *node = client->nodes + k;
+			if (node->finalizer) {
+				node->finalizer(node->conn);
+			}
+			resp_buf_free(&node->obuf);
+			resp_buf_free(&node->ibuf);
+		}
+		free(client->nodes);
+		free(client);
+	}
+	free(me->trk_r_clients);
+	me->trk_r_clients = NULL;
+}
+
+static int setup_client_node(struct trk_client_node *n,struct func *f,char *host,char *port,
+		struct event_base *base){
 	assert(n);
 
 	strncpy(n->host, host, sizeof(n->host));
@@ -236,37 +484,47 @@ static void setup_client_node(struct trk_client_node *n,struct func *f,char *hos
 	n->db = f->db;
 
 	if(memcmp(f->sink_type,"mysql",5) == 0){
-		MYSQL *conn = mysql_init(NULL);
-		if(conn == NULL){
-			fprintf(stderr, "init MYSQL conn failed\n");
-			exit(1);
-		}
-
-		if(!mysql_real_connect(conn,n->host,n->user,n->pass,n->db,n->port,NULL,0)){
-			mysql_close(conn);
+		n->timeout_ms = f->mysql_timeout * 1000;
+		n->conn = mysql_sink_connect(n);
+		if(n->conn == NULL){
 			fprintf(stderr, "create mysql client failed\n");
-			exit(1);
+			return TRACKD_ERR;
 		}
 
-		n->conn = conn;
 		n->proc = mysql_proc;
+		n->proc_batch = mysql_proc_batch;
 		n->finalizer = mysql_finalizer;
+	}else if(memcmp(f->sink_type,"redis",5) == 0 && f->redis_async){
+		n->async = 1;
+		n->max_inflight = f->redis_max_inflight;
+		n->timeout_ms   = f->redis_timeout_ms;
+		if(redis_async_connect(n, base, f) == NULL){
+			fprintf(stderr, "create redis client failed\n");
+			return TRACKD_ERR;
+		}
+		n->proc = redis_async_proc;
+		n->proc_batch = redis_async_proc_batch;
+		n->finalizer = redis_async_finalizer;
 	}else if(memcmp(f->sink_type,"redis",5) == 0){
 		/* create redis clients */
-		redisContext *conn = redisConnect(n->host,n->port);
-		if(conn->err) {
-			redisFree(conn);  
+		n->timeout_ms = f->redis_timeout_ms;
+		n->conn = redis_connect(n);
+		if(n->conn == NULL) {
 			fprintf(stderr, "create redis client failed\n");
-			exit(1);
+			return TRACKD_ERR;
 		}
 
-		n->conn = conn;
+		redis_script_load(n, f);
 		n->proc = redis_proc;
+		n->proc_batch = redis_proc_batch;
+		n->agg = redis_agg;
+		n->agg_flush = redis_agg_flush;
 		n->finalizer = redis_finalizer;
 	}else{
 		fprintf(stderr, "init sink server failure,unknown sink_type\n");
 		exit(1);
 	}
+	return TRACKD_OK;
 }
 
 struct trk_thread *trk_thread_choose_one(int idx)
@@ -274,11 +532,16 @@ struct trk_thread *trk_thread_choose_one(int idx)
 	return threads + idx;
 }
 
+int trk_thread_active(void)
+{
+	return active_workers;
+}
+
 
 /*
  * Creates a worker thread.
  */
-static void create_worker(void *(*func)(void *), void *arg)
+static pthread_t create_worker(void *(*func)(void *), void *arg)
 {
 	pthread_t       thread;
 	pthread_attr_t  attr;
@@ -289,6 +552,7 @@ static void create_worker(void *(*func)(void *), void *arg)
 		fprintf(stderr, "can't create thread: %s\n", strerror(ret));
 		exit(1);
 	}
+	return thread;
 }
 
 
@@ -300,104 +564,1132 @@ static void *worker_libevent_loop(void *arg)
 	//pthread_detach(pthread_self());
 
 	struct trk_thread *me = arg;
+	int j;
 
 	/* Any per-thread setup can happen here; trk_thread_init() will block until
 	 * all threads have finished initializing.
 	 */
 
+	/* pin first: the pools are then first touched on our own numa node */
+	if (g_settings->worker_cpus) {
+		int cpu = g_settings->worker_cpus->cpus[me->idx % g_settings->worker_cpus->n];
+		if (topology_pin_cpu(cpu) != TRACKD_OK) {
+			fprintf(stderr, "can't pin worker %d to cpu %d\n", me->idx, cpu);
+		}
+	}
+
+	trk_thread_self = me;
+	me->tid = pthread_self();
+
+	/* a restarted worker keeps its batch and pools */
+	if (!me->batch) {
+		me->batch = calloc(TRK_DRAIN_BATCH, me->batch_len);
+	}
+	if (!me->batch) {
+		fprintf(stderr, "init buffer pool failure\n");
+		exit(1);
+	}
+	/* per_core workers sink what they receive, nothing is queued */
+	for (j = 0; j < g_settings->num_lanes && g_settings->mode == TRK_MODE_PIPELINE; j++) {
+		struct func *f = g_settings->lanes[j];
+		if (me->lanes[j].pool) {
+			continue;
+		}
+		me->lanes[j].priority = f->lane_priority;
+		me->lanes[j].weight   = f->lane_weight;
+		me->lanes[j].pool     = pool_new(f->pool_bytes, TRK_POOL_CELL,
+				g_settings->hugepages ? POOL_HUGEPAGES : 0);
+		if (!me->lanes[j].pool) {
+			fprintf(stderr, "init buffer pool of op %d failure\n", f->op);
+			exit(1);
+		}
+	}
+
+	/* sockets and the like, also on our own node */
+	if (thread_attach) {
+		thread_attach(me);
+	}
+
+	/* and wait for the others, thieves look at their pools */
 	pthread_mutex_lock(&init_lock);
 	init_count++;
-	pthread_cond_signal(&init_cond);
+	me->running = 1;
+	pthread_cond_broadcast(&init_cond);
+	while (init_count < init_workers) {
+		pthread_cond_wait(&init_cond, &init_lock);
+	}
 	pthread_mutex_unlock(&init_lock);
 
-	event_base_loop(me->base, 0);
+	if (g_settings->worker_mode == TRK_WORKER_BUSYPOLL) {
+		trk_thread_busypoll(me);
+	} else {
+		event_base_loop(me->base, 0);
+	}
 	return NULL;
 }
 
 
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+
+/**
+ * busypoll worker loop: spin on notify_pending for busypoll_spin_us of
+ * idle time, then sched_yield() up to busypoll_yield_us, then stop
+ * polling and block in the event loop until notified
+ */
+static void trk_thread_busypoll(struct trk_thread *me)
+{
+	uint64_t idle_since = 0, now, idle;
+	unsigned int spins = 0;
+
+	me->polling = 1;
+	while (me->running) {
+		/* timers, and the sockets of per_core mode */
+		if (g_settings->mode == TRK_MODE_PER_CORE || (++spins & 63) == 0) {
+			event_base_loop(me->base, EVLOOP_NONBLOCK);
+		}
+
+		if (me->notify_pending) {
+			trk_thread_wakeup(me);
+			idle_since = 0;
+			continue;
+		}
+
+		now = trk_clock_us();
+		if (idle_since == 0) {
+			idle_since = now;
+		}
+		idle = now - idle_since;
+
+		if (idle < (uint64_t)g_settings->busypoll_spin_us) {
+			cpu_relax();
+		} else if (idle < (uint64_t)(g_settings->busypoll_spin_us + g_settings->busypoll_yield_us)) {
+			sched_yield();
+		} else {
+			/* producers signal again from now on, see trk_thread_notify() */
+			me->polling = 0;
+			__sync_synchronize();
+			if (!me->notify_pending) {
+				event_base_loop(me->base, EVLOOP_ONCE);
+			}
+			me->polling = 1;
+			idle_since = 0;
+		}
+	}
+}
+
+
 
 /**
- * Processes an incoming track message. This is called when
- * input arrives on the libevent wakeup pipe.
+ * signal the worker, only on the empty->non-empty transition:
+ * while a wakeup is pending the worker is going to drain our item anyway
+ */
+void trk_thread_notify(struct trk_thread *t)
+{
+	uint64_t now;
+
+	/* order the publish in pool_push() before reading notify_pending */
+	__sync_synchronize();
+	if (t->notify_pending) {
+		return;
+	}
+	/* read before the flag is set, stored by the producer that set it */
+	now = trk_clock_us();
+	if (!__sync_bool_compare_and_swap(&t->notify_pending, 0, 1)) {
+		return;
+	}
+	t->notify_us = now;
+	/* a busypoll worker sees the flag, the cas ordered polling's read */
+	if (t->polling) {
+		return;
+	}
+
+#ifdef __linux__
+	uint64_t one = 1;
+	if (write(t->notify_send_fd, &one, sizeof(one)) != sizeof(one)) {
+		fprintf(stderr, "write thread notify eventfd failure\n");
+	}
+#else
+	if (write(t->notify_send_fd, "", 1) != 1) {
+		fprintf(stderr, "write thread notify pipe failure\n");
+	}
+#endif
+}
+
+
+int trk_thread_enter(struct trk_thread *t)
+{
+	/* pairs with the retiring worker: it clears accepting, then reads pushing */
+	__sync_fetch_and_add(&t->pushing, 1);
+	if (t->accepting) {
+		return TRACKD_OK;
+	}
+	__sync_fetch_and_sub(&t->pushing, 1);
+	return TRACKD_ERR;
+}
+
+
+void trk_thread_leave(struct trk_thread *t)
+{
+	__sync_fetch_and_sub(&t->pushing, 1);
+}
+
+
+/**
+ * Processes incoming track messages. This is called when
+ * the worker is woken up, and drains everything queued.
  */
 static void libevent_cb_worker_notify(int fd, short which, void *arg)
 {
 	struct trk_thread *me = arg;
-	char buf[1];
+	char buf[64];
+
+	if (read(fd, buf, sizeof(buf)) <= 0) {
+		fprintf(stderr, "read thread notify fd failure\n");
+	}
 
-	if (read(fd, buf, 1) != 1) {
-		fprintf(stderr, "read thread notify pipe failure\n");
+	/* a busypoll worker may have taken the wakeup already */
+	if (me->notify_pending) {
+		trk_thread_wakeup(me);
 	}
+}
 
-	struct trk_item trk_item;
-	memset(&trk_item, 0, sizeof(struct trk_item));
 
-	if (pool_pop(me->pool, &trk_item) != 0) {
-		fprintf(stderr, "pool_pop() failure\n");
-		return;
+/**
+ * the notified worker: re-arm, then drain everything queued
+ */
+static void trk_thread_wakeup(struct trk_thread *me)
+{
+	uint64_t now = trk_clock_us();
+	uint64_t sent = me->notify_us;
+
+	/*
+	 * a busypoll worker may see the flag before notify_us is stored:
+	 * what it reads then is of an earlier wakeup, skip the sample
+	 */
+	if (sent > me->woken_us && now >= sent) {
+		uint64_t wake = now - sent;
+		me->wake_us_avg += ((int64_t)wake - (int64_t)me->wake_us_avg) / 8;
+		if (wake > me->wake_us_max) {
+			me->wake_us_max = wake;
+		}
+	}
+	me->woken_us = now;
+
+	/*
+	 * re-arm before draining: an item published after our last
+	 * pool_pop_batch() will see 0 and signal again
+	 */
+	__sync_lock_release(&me->notify_pending);
+	__sync_synchronize();
+
+	trk_thread_work(me);
+
+	/* asked to retire, see trk_thread_retire() */
+	if (me->retire == 1) {
+		struct timeval tv = {0, TRK_RETIRE_GRACE_MS * 1000};
+		me->retire = 2;
+		evtimer_set(&me->retire_event, libevent_cb_worker_retire, me);
+		event_base_set(me->base, &me->retire_event);
+		evtimer_add(&me->retire_event, &tv);
+	}
+}
+
+
+/**
+ * the previous process' wal, the pools, then the spill
+ */
+static void trk_thread_work(struct trk_thread *me)
+{
+	size_t i, n;
+
+	/* the previous worker process' items go first, see wal.h */
+	if (me->wal && wal_replay_pending(me->wal)) {
+		int rounds = TRK_SPILL_REPLAY_BATCHES;
+		while (rounds-- > 0 && (n = wal_replay(me->wal, me->batch,
+						sizeof(struct trk_item), TRK_DRAIN_BATCH)) > 0) {
+			for (i = 0; i < n; i++) {
+				me->batch[i].lsn = 0;
+			}
+			trk_thread_process_batch(me, n, me);
+		}
+		if (wal_replay_pending(me->wal)) {
+			trk_thread_notify(me);
+		}
+	}
+
+	trk_thread_drain(me);
+
+	/* the backlog cleared, replay what overflowed to disk */
+	if (me->spill && spill_pending(me->spill)) {
+		int rounds = TRK_SPILL_REPLAY_BATCHES;
+		while (rounds-- > 0 && (n = spill_read(me->spill, me->batch,
+						sizeof(struct trk_item), TRK_DRAIN_BATCH)) > 0) {
+			trk_thread_process_batch(me, n, me);
+			__sync_fetch_and_add(&g_running->replayed, n);
+			if (trk_thread_pool_size(me) > 0) {
+				break;
+			}
+		}
+		__sync_fetch_and_add(&g_running->discarded, spill_take_bad(me->spill));
+		/* come back after the other events */
+		if (spill_pending(me->spill)) {
+			trk_thread_notify(me);
+		}
 	}
+}
+
+
+/**
+ * a retiring worker: once no producer is left between enter and leave
+ * nothing new comes in, drain what they queued, then hang up the sinks
+ * and leave the loop
+ */
+static void libevent_cb_worker_retire(int fd, short which, void *arg)
+{
+	struct trk_thread *me = arg;
+	struct timeval tv = {0, TRK_RETIRE_GRACE_MS * 1000};
+	int j;
 
-	const char *func_name = g_settings->op_funcs[trk_item.op]->func;
-	if (func_name == NULL) {
+	/* accepting was cleared before, see trk_thread_enter() */
+	int pushing = __sync_fetch_and_add(&me->pushing, 0);
+
+	trk_thread_work(me);
+	/* async nodes answer what was coalesced before they hang up */
+	for (j = 0; j < g_settings->num_op_funcs; j++) {
+		struct trk_sink_client *client = me->trk_r_clients[j];
+		if (client && client->coalesce) {
+			trk_thread_coalesce_flush(client);
+		}
+	}
+	if (pushing > 0 || trk_thread_backlog(me) || trk_thread_inflight(me) > 0) {
+		evtimer_add(&me->retire_event, &tv);
 		return;
 	}
 
-	int try_times = 0;
-	struct trk_client_node *node;
-	struct trk_sink_client *client = me->trk_r_clients[trk_item.op];
+	trk_thread_close_sink_client(me);
+	me->retire  = 0;
+	me->running = 0;
+	event_base_loopbreak(me->base);
+}
 
-	//return value of sink data
-	int ret;
 
-	while (1) {
-		if (++try_times > client->num_clients) { break; }
+void trk_thread_sink(struct trk_thread *me, struct trk_item *item)
+{
+	trk_thread_process_run(me, item, 1);
+}
 
-		/* 加1求余轮询 */
-		int client_idx = (client->client_idx + 1) % client->num_clients;
-		client->client_idx = client_idx;
 
-		node = client->nodes + client_idx;
+void trk_thread_resink(struct trk_item *item, struct trk_thread *from)
+{
+	struct trk_thread *me = trk_thread_self;
 
-		if (node->last_err_time > 0) {   /* 最近发生过错误 */
-			if (time(NULL) - node->last_err_time <= TRK_ERR_IGNORE_TIME) {
-				continue;  /* N秒内刚发生，排除之，选择下一个 */
-			} else {
-				node->last_err_time = time(NULL);    /* 立刻更新错误时间 */
+	if (me && me->trk_r_clients) {
+		struct trk_thread *batch_from = me->batch_from;
+		me->batch_from = from;
+		trk_thread_process_run(me, item, 1);
+		me->batch_from = batch_from;
+	}
+	/* not taken over by another async node */
+	if (from && from->wal && item->lsn) {
+		wal_ack(from->wal, &item->lsn, 1);
+	}
+}
 
-				const char* sink_type = g_settings->op_funcs[trk_item.op]->sink_type;
 
-				if(memcmp(sink_type,"mysql",5) == 0){
-					//mysql_close(node->conn);
-					if(!mysql_real_connect(node->conn,
-								node->host,node->user,node->pass,node->db,node->port,NULL,0)){
-						fprintf(stderr, "create mysql client failed\n");
-						exit(1);
-					}
-				}else if(memcmp(sink_type,"redis",5) == 0){
-					/* create redis clients */
+void trk_thread_sink_ready(void)
+{
+	struct trk_thread *me = trk_thread_self;
 
-					if(node->conn != NULL){
-						redisFree((redisContext*)node->conn);
-					}
+	if (me && me->sink_blocked) {
+		me->sink_blocked = 0;
+		trk_thread_notify(me);
+	}
+}
 
-					node->conn = redisConnect(node->host,node->port);
-					if(((redisContext*)(node->conn))->err) {
-						redisFree((redisContext*)node->conn);  
-						continue;
-					}
-				}
-			}
+
+/* an async node of op has max_inflight commands out, or its agg is stalled */
+static int trk_thread_sink_full(struct trk_thread *me, int op)
+{
+	struct trk_sink_client *client = me->trk_r_clients[op];
+	int k;
+
+	if (client && client->agg_stalled) {
+		return 1;
+	}
+	for (k = 0; client && k < client->num_clients; k++) {
+		struct trk_client_node *node = client->nodes + k;
+		if (node->max_inflight > 0 && node->inflight >= node->max_inflight) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* commands of all async nodes not answered yet */
+static int trk_thread_inflight(struct trk_thread *me)
+{
+	int j, k, n = 0;
+
+	for (j = 0; me->trk_r_clients && j < g_settings->num_op_funcs; j++) {
+		struct trk_sink_client *client = me->trk_r_clients[j];
+		for (k = 0; client && k < client->num_clients; k++) {
+			n += client->nodes[k].inflight;
 		}
+	}
+	return n;
+}
 
-		ret = node->proc(node,&trk_item);
 
-		/* if failure, try n times. still failure, ignore this data item */
-		if (ret == TRACKD_OK) {
-			node->last_err_time = 0;         /* clear last err time */
-			break;
-		} else {
-			node->last_err_time = time(NULL);  /* set last err time */
+/* items queued to a worker, in its pools, spill or wal to replay */
+static int trk_thread_backlog(struct trk_thread *me)
+{
+	return trk_thread_pool_size(me) > 0 ||
+		(me->spill && spill_pending(me->spill)) ||
+		(me->wal && wal_replay_pending(me->wal));
+}
+
+
+/**
+ * steal from the worker with the biggest backlog while we are idle:
+ * highest priority lanes first, sunk with our own clients
+ */
+static void libevent_cb_worker_steal(int fd, short which, void *arg)
+{
+	struct trk_thread *me = arg;
+	struct trk_thread *victim = NULL;
+	struct timeval tv = {0, TRK_STEAL_INTERVAL_MS * 1000};
+	size_t most = TRK_STEAL_MIN_BYTES, n;
+	int i, j, batches = 0;
+
+	if (trk_thread_pool_size(me) == 0) {
+		for (i = 0; i < g_settings->max_worker_threads; i++) {
+			size_t size;
+			if (&threads[i] == me) {
+				continue;
+			}
+			size = trk_thread_pool_size(&threads[i]);
+			if (size >= most) {
+				most   = size;
+				victim = &threads[i];
+			}
 		}
-	} /* /while */
+	}
+
+	for (j = 0; victim && j < g_settings->num_lanes && batches < TRK_STEAL_BATCHES; j++) {
+		/* it would only go back to the victim */
+		if (trk_thread_sink_full(me, g_settings->lanes[j]->op)) {
+			continue;
+		}
+		while (batches < TRK_STEAL_BATCHES && (n = pool_pop_batch(victim->lanes[j].pool,
+						me->batch, sizeof(struct trk_item), TRK_DRAIN_BATCH)) > 0) {
+			trk_thread_process_batch(me, n, victim);
+			__sync_fetch_and_add(&g_running->stolen, n);
+			batches++;
+		}
+	}
+	if (batches > 0) {
+		__sync_fetch_and_add(&g_running->steals, 1);
+	}
+
+	evtimer_add(&me->steal_event, &tv);
+}
+
+
+/**
+ * drain the lanes until they are all empty: a round of deficit round
+ * robin over the lanes of the highest priority that has items, then
+ * look from the top again. A lane whose async node is full is left
+ * until trk_thread_sink_ready()
+ */
+static void trk_thread_drain(struct trk_thread *me)
+{
+	int l = 0, end, j;
+	size_t i, n;
+
+	/* per_core workers have no pools */
+	if (g_settings->mode != TRK_MODE_PIPELINE) {
+		return;
+	}
+	while (l < g_settings->num_lanes) {
+		int busy = 0;
+
+		/* lanes [l, end) share a priority */
+		for (end = l + 1; end < g_settings->num_lanes &&
+				me->lanes[end].priority == me->lanes[l].priority; end++);
+
+		for (j = l; j < end; j++) {
+			struct trk_lane *lane = &me->lanes[j];
+			int op = g_settings->lanes[j]->op, full = 0;
+
+			lane->deficit += lane->weight * TRK_LANE_QUANTUM;
+			while (lane->deficit > 0 && !(full = trk_thread_sink_full(me, op)) &&
+					(n = pool_pop_batch(lane->pool, me->batch,
+							sizeof(struct trk_item),
+							lane->deficit < TRK_DRAIN_BATCH ? lane->deficit : TRK_DRAIN_BATCH)) > 0) {
+				uint64_t now = trk_clock_us();
+				for (i = 0; i < n; i++) {
+					uint64_t wait = now > me->batch[i].enq_us ? now - me->batch[i].enq_us : 0;
+					lane->wait_us_avg += ((int64_t)wait - (int64_t)lane->wait_us_avg) / 8;
+					if (wait > lane->wait_us_max) {
+						lane->wait_us_max = wait;
+					}
+				}
+				lane->deficit -= n;
+				trk_thread_process_batch(me, n, me);
+				busy = 1;
+			}
+			if (full) {
+				me->sink_blocked = 1;
+			}
+			/* an emptied lane keeps no credit */
+			if (lane->deficit > 0) {
+				lane->deficit = 0;
+			}
+		}
+
+		l = busy ? 0 : end;
+	}
+}
+
+
+size_t trk_thread_pool_size(struct trk_thread *t)
+{
+	size_t size = 0;
+	int j;
+
+	for (j = 0; j < g_settings->num_lanes; j++) {
+		if (t->lanes[j].pool) {
+			size += pool_size(t->lanes[j].pool);
+		}
+	}
+	return size;
+}
+
+
+/**
+ * sink the first n items of me->batch, then ack them in the wal of
+ * from, the worker they were queued to. An item whose lsn was cleared
+ * meanwhile is acked by whoever took it over, see trk_thread_putback()
+ */
+static void trk_thread_process_batch(struct trk_thread *me, size_t n, struct trk_thread *from)
+{
+	uint64_t lsns[TRK_DRAIN_BATCH];
+	uint64_t start = trk_clock_us();
+	struct wal *wal = from->wal;
+	size_t i, j;
+
+	/* runs of one op go to its sink together */
+	me->batch_from = from;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && me->batch[j].op == me->batch[i].op; j++);
+		trk_thread_process_run(me, me->batch + i, j - i);
+	}
+	me->batch_from = NULL;
+
+	for (i = 0; i < n; i++) {
+		lsns[i] = me->batch[i].lsn;
+		if (me->route_hits) {
+			uint32_t *h = &me->route_hits[route_bucket(me->batch[i].op, me->batch[i].trk_id)];
+			/* only we write it, route_rebalance() reads it as it goes */
+			__atomic_store_n(h, *h + 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (wal) {
+		wal_ack(wal, lsns, n);
+	}
+	me->busy_us += trk_clock_us() - start;
+}
+
+
+/**
+ * group commit of every worker's wal, every wal_sync_ms
+ */
+static void *wal_sync_loop(void *arg)
+{
+	int i;
+
+	topology_pin(g_settings->misc_cpus);
+
+	while (!stopping) {
+		usleep(g_settings->wal_sync_ms * 1000);
+		for (i = 0; i < g_settings->max_worker_threads; i++) {
+			if (threads[i].wal) {
+				wal_sync(threads[i].wal);
+			}
+		}
+	}
+	return NULL;
+}
+
+
+struct trk_thread *trk_thread_route(uint32_t op, uint64_t trk_id)
+{
+	return &threads[route_pick(route, op, trk_id)];
+}
+
+
+/**
+ * move hot route buckets off busy workers, every rebalance_interval
+ */
+static void *route_rebalance_loop(void *arg)
+{
+	uint32_t **hits = malloc(g_settings->num_worker_threads * sizeof(uint32_t *));
+	int i;
+
+	if (!hits) {
+		fprintf(stderr, "can't allocate route counters\n");
+		return NULL;
+	}
+	topology_pin(g_settings->misc_cpus);
+	for (i = 0; i < g_settings->num_worker_threads; i++) {
+		hits[i] = threads[i].route_hits;
+	}
+
+	while (1) {
+		sleep(g_settings->rebalance_interval);
+		int moves = route_rebalance(route, hits, TRK_REBALANCE_MOVES);
+		__sync_fetch_and_add(&g_running->route_moves, moves);
+	}
+	return NULL;
+}
+
+
+/**
+ * run a worker's loop again, back once its pools are allocated
+ */
+static int trk_thread_spawn(struct trk_thread *me)
+{
+	if (trk_thread_setup_sink_client(me) != TRACKD_OK) {
+		return TRACKD_ERR;
+	}
+	create_worker(worker_libevent_loop, me);
+
+	pthread_mutex_lock(&init_lock);
+	while (!me->running) {
+		pthread_cond_wait(&init_cond, &init_lock);
+	}
+	pthread_mutex_unlock(&init_lock);
+	return TRACKD_OK;
+}
+
+
+/**
+ * bring up worker active_workers, it takes events from now on
+ */
+static int trk_thread_start(struct trk_thread *me)
+{
+	if (trk_thread_spawn(me) != TRACKD_OK) {
+		return TRACKD_ERR;
+	}
+	me->accepting = 1;
+	__sync_fetch_and_add(&active_workers, 1);
+	return TRACKD_OK;
+}
+
+
+/**
+ * retire the last active worker: producers turn away from it, it drains
+ * what it has and exits, see libevent_cb_worker_retire()
+ */
+static void trk_thread_retire(struct trk_thread *me)
+{
+	me->accepting = 0;
+	__sync_fetch_and_sub(&active_workers, 1);
+	me->retire = 1;
+	/* order retire before reading notify_pending */
+	__sync_synchronize();
+	trk_thread_notify(me);
+	pthread_join(me->tid, NULL);
+}
+
+
+/**
+ * grow the workers while the pools fill up or the workers are busy
+ * sinking, shrink them while both are low; either has to hold for
+ * a few autoscale_interval in a row
+ */
+static void *autoscale_loop(void *arg)
+{
+	int nthreads = g_settings->max_worker_threads;
+	uint64_t *busy_last = calloc(nthreads, sizeof(uint64_t));
+	int i, j, up = 0, down = 0;
+
+	if (!busy_last) {
+		fprintf(stderr, "can't allocate autoscale counters\n");
+		return NULL;
+	}
+	topology_pin(g_settings->misc_cpus);
+
+	while (1) {
+		sleep(g_settings->autoscale_interval);
+
+		pthread_mutex_lock(&scale_lock);
+		if (stopping) {
+			pthread_mutex_unlock(&scale_lock);
+			break;
+		}
+
+		int n = active_workers;
+		size_t size = 0, capacity = 0;
+		uint64_t busy = 0;
+		for (i = 0; i < nthreads; i++) {
+			uint64_t b = threads[i].busy_us;
+			if (i < n) {
+				for (j = 0; j < g_settings->num_lanes; j++) {
+					size     += pool_size(threads[i].lanes[j].pool);
+					capacity += threads[i].lanes[j].pool->bytes;
+				}
+				busy += b - busy_last[i];
+			}
+			busy_last[i] = b;
+		}
+
+		/* in percent */
+		int occupancy = capacity ? (int)(size * 100 / capacity) : 0;
+		int load = (int)(busy * 100 / ((uint64_t)g_settings->autoscale_interval * 1000000 * n));
+		/* what the others would take on without one */
+		int load_less = n > 1 ? load * n / (n - 1) : 100;
+
+		if (occupancy >= TRK_SCALE_UP_OCCUPANCY || load >= TRK_SCALE_UP_LOAD) {
+			up++;
+			down = 0;
+		} else if (occupancy <= TRK_SCALE_DOWN_OCCUPANCY && load_less < TRK_SCALE_UP_LOAD) {
+			down++;
+			up = 0;
+		} else {
+			up = down = 0;
+		}
+
+		if (up >= TRK_SCALE_UP_TICKS && n < g_settings->max_worker_threads) {
+			up = 0;
+			if (trk_thread_start(&threads[n]) == TRACKD_OK) {
+				__sync_fetch_and_add(&g_running->scale_ups, 1);
+			}
+		} else if (down >= TRK_SCALE_DOWN_TICKS && n > g_settings->min_worker_threads) {
+			down = 0;
+			trk_thread_retire(&threads[n - 1]);
+			__sync_fetch_and_add(&g_running->scale_downs, 1);
+		}
+		pthread_mutex_unlock(&scale_lock);
+	}
+	free(busy_last);
+	return NULL;
+}
+
+
+int trk_thread_stopping(void)
+{
+	return stopping;
+}
+
+
+/**
+ * stop the workers for the process to exit: producers are turned away,
+ * then every worker is retired, so it drains what it has, flushes and
+ * hangs up its sinks on its own thread and leaves its loop. A retired
+ * worker still holding items is run again for that. Once they are all
+ * joined their pools, spill, wal and base are freed
+ */
+void trk_thread_shutdown(void)
+{
+	uint64_t told = 0;  /* max_worker_threads <= 64 */
+	int i, j;
+
+	pthread_mutex_lock(&scale_lock);
+	stopping = 1;
+	__sync_synchronize();
+	for (i = 0; i < g_settings->max_worker_threads; i++) {
+		threads[i].accepting = 0;
+	}
+	__sync_synchronize();
+
+	for (i = 0; i < g_settings->max_worker_threads; i++) {
+		struct trk_thread *me = &threads[i];
+		if (!me->running && (!trk_thread_backlog(me) ||
+					trk_thread_spawn(me) != TRACKD_OK)) {
+			continue;
+		}
+		me->retire = 1;
+		__sync_synchronize();
+		trk_thread_notify(me);
+		told |= 1ULL << i;
+	}
+	for (i = 0; i < g_settings->max_worker_threads; i++) {
+		if (told & (1ULL << i)) {
+			pthread_join(threads[i].tid, NULL);
+		}
+	}
+	pthread_mutex_unlock(&scale_lock);
+
+	if (g_settings->wal_dir) {
+		pthread_join(wal_sync_tid, NULL);
+	}
+
+	for (i = 0; i < g_settings->max_worker_threads; i++) {
+		struct trk_thread *me = &threads[i];
+
+		for (j = 0; j < g_settings->num_lanes; j++) {
+			if (me->lanes[j].pool) {
+				pool_free(me->lanes[j].pool);
+			}
+		}
+		if (me->spill) {
+			spill_free(me->spill);
+		}
+		if (me->wal) {
+			wal_close(me->wal);
+		}
+		event_base_free(me->base);
+	}
+}
+
+
+/**
+ * the next client node of an op, round robin: a node that failed is
+ * skipped for TRK_ERR_IGNORE_TIME, then reconnected. NULL if skipped
+ */
+static struct trk_client_node *next_client_node(struct func *f, struct trk_sink_client *client)
+{
+	struct trk_client_node *node;
+
+	/* 加1求余轮询 */
+	int client_idx = (client->client_idx + 1) % client->num_clients;
+	client->client_idx = client_idx;
+
+	node = client->nodes + client_idx;
+
+	if (node->last_err_time > 0) {   /* 最近发生过错误 */
+		if (time(NULL) - node->last_err_time <= TRK_ERR_IGNORE_TIME) {
+			return NULL;  /* N秒内刚发生，排除之，选择下一个 */
+		}
+		node->last_err_time = time(NULL);    /* 立刻更新错误时间 */
+
+		const char* sink_type = f->sink_type;
+
+		if(memcmp(sink_type,"mysql",5) == 0){
+			/* a lost connection was dropped, see mysql_proc_batch() */
+			if(node->conn == NULL && (node->conn = mysql_sink_connect(node)) == NULL){
+				return NULL;
+			}
+		}else if(memcmp(sink_type,"redis",5) == 0 && node->async){
+			/* a live connection just had error replies, keep it */
+			if(node->conn == NULL &&
+					redis_async_connect(node, client->thread->base, f) == NULL){
+				return NULL;
+			}
+		}else if(memcmp(sink_type,"redis",5) == 0){
+			/* create redis clients */
+
+			if(node->conn != NULL){
+				redisFree((redisContext*)node->conn);
+			}
+
+			node->conn = redis_connect(node);
+			if(node->conn == NULL) {
+				return NULL;
+			}
+			redis_script_load(node, f);
+		}
+	}
+	return node;
+}
+
+
+/**
+ * write out an op's aggregates: what a node failed goes to the next
+ * one, what none took is put back for the next window
+ */
+static void trk_thread_agg_flush(struct trk_sink_client *client)
+{
+	struct func *f = op_func_get(g_settings, client->op);
+	struct trk_client_node *node;
+	struct agg_entry *e;
+	size_t n, i, k;
+	int try_times;
+
+	e = agg_take(client->agg, &n);
+	if (n == 0) {
+		return;
+	}
+
+	for (try_times = 0; n > 0 && try_times < client->num_clients; try_times++) {
+		node = next_client_node(f, client);
+		if (node == NULL) {
+			continue;
+		}
+		if (node->agg_flush(node, e, n) == TRACKD_OK) {
+			node->last_err_time = 0;
+			__sync_fetch_and_add(&g_running->agg_writes, n);
+			return;
+		}
+		node->last_err_time = time(NULL);
+
+		for (i = k = 0; i < n; i++) {
+			if (e[i].err) {
+				e[k++] = e[i];
+			}
+		}
+		__sync_fetch_and_add(&g_running->agg_writes, n - k);
+		n = k;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (agg_put_back(client->agg, e + i) != 0) {
+			__sync_fetch_and_add(&g_running->discarded, 1);
+		}
+	}
+}
+
+
+/**
+ * write out the latest item of every key, in chunks like a drain
+ */
+static void trk_thread_coalesce_flush(struct trk_sink_client *client)
+{
+	struct func *f = op_func_get(g_settings, client->op);
+	struct trk_item *items;
+	size_t n, i;
+
+	items = coalesce_items(client->coalesce, &n);
+	for (i = 0; i < n; i += TRK_DRAIN_BATCH) {
+		trk_thread_write_run(client->thread, f, client, items + i,
+				n - i < TRK_DRAIN_BATCH ? n - i : TRK_DRAIN_BATCH);
+	}
+	__sync_fetch_and_add(&g_running->coalesce_writes, n);
+	coalesce_clear(client->coalesce);
+}
+
+
+/**
+ * flush every agg_window_ms or coalesce_ms, plus some jitter so the
+ * workers don't all write at the window boundaries
+ */
+static void libevent_cb_client_flush(int fd, short which, void *arg)
+{
+	struct trk_sink_client *client = arg;
+	struct func *f = op_func_get(g_settings, client->op);
+	int ms, jitter;
+
+	if (client->agg) {
+		trk_thread_agg_flush(client);
+		/* the lane was held on a full agg, see trk_thread_process_run() */
+		client->agg_stalled = 0;
+		trk_thread_sink_ready();
+		ms     = f->agg_window_ms;
+		jitter = f->agg_jitter_ms;
+	} else {
+		trk_thread_coalesce_flush(client);
+		ms     = f->coalesce_ms;
+		jitter = f->coalesce_ms / 10;
+	}
+
+	if (jitter > 0) {
+		ms += rand_r(&client->flush_seed) % (jitter + 1);
+	}
+	struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+	evtimer_add(&client->flush_event, &tv);
+}
+
+
+/**
+ * sink a track message with the op's clients of this thread
+ */
+static void trk_thread_process(struct trk_thread *me, struct trk_item *trk_item)
+{
+	struct func *f = op_func_get(g_settings, trk_item->op);
+	if (f == NULL || f->func == NULL) {
+		return;
+	}
+
+	int try_times = 0;
+	struct trk_client_node *node;
+	struct trk_sink_client *client = me->trk_r_clients[trk_item->op];
+	if (client == NULL) {
+		return;
+	}
+
+	//return value of sink data
+	int ret;
+
+	while (1) {
+		if (++try_times > client->num_clients) { break; }
+
+		node = next_client_node(f, client);
+		if (node == NULL) {
+			continue;
+		}
+
+		ret = node->proc(node,trk_item);
+
+		/* if failure, try n times. still failure, ignore this data item */
+		if (ret == TRACKD_OK) {
+			node->last_err_time = 0;         /* clear last err time */
+			break;
+		} else if (ret == TRK_ITEM_DROP) {
+			__sync_fetch_and_add(&g_running->discarded, 1);
+			break;
+		} else {
+			node->last_err_time = time(NULL);  /* set last err time */
+		}
+	} /* /while */
+}
+
+
+/**
+ * put an item of the batch back on its lane, to be sunk later: on the
+ * lane of the worker whose wal has it, the item is then acked once sunk
+ * from there and not with this batch. If that worker retired meanwhile
+ * it goes on ours without its lsn, acked with this batch
+ */
+static int trk_thread_putback(struct trk_thread *me, struct func *f, struct trk_item *item)
+{
+	struct trk_thread *to = me->batch_from ? me->batch_from : me;
+	uint64_t lsn = item->lsn;
+	int ret;
+
+	if (to != me && trk_thread_enter(to) != TRACKD_OK) {
+		if (me->lanes[f->lane].pool == NULL) {
+			return TRACKD_ERR;
+		}
+		item->lsn = 0;
+		ret = pool_push(me->lanes[f->lane].pool, item, trk_item_len(item));
+		item->lsn = lsn;
+		return ret == 0 ? TRACKD_OK : TRACKD_ERR;
+	}
+
+	ret = to->lanes[f->lane].pool ?
+		pool_push(to->lanes[f->lane].pool, item, trk_item_len(item)) : -1;
+	if (to != me) {
+		if (ret == 0) {
+			trk_thread_notify(to);
+		}
+		trk_thread_leave(to);
+	}
+	if (ret != 0) {
+		return TRACKD_ERR;
+	}
+	item->lsn = 0;
+	return TRACKD_OK;
+}
+
+
+/**
+ * sink n items of one op, into the op's aggregation or coalescing
+ * buffer if it has one
+ */
+static void trk_thread_process_run(struct trk_thread *me, struct trk_item *items, size_t n)
+{
+	struct func *f = op_func_get(g_settings, items->op);
+	struct trk_sink_client *client;
+	size_t i;
+
+	if (f == NULL || f->func == NULL) {
+		return;
+	}
+	client = me->trk_r_clients[items->op];
+	if (client == NULL) {
+		return;
+	}
+
+	/*
+	 * aggregated, written out by the flush timer. Full: flush once, if
+	 * that did not make room the sink is behind, hold the lane until the
+	 * timer flushed and put the rest back on it
+	 */
+	if (client->agg) {
+		size_t folded = 0;
+		for (i = 0; i < n; i++) {
+			if (client->nodes->agg(client->agg, items + i, f->agg_func) == TRACKD_OK) {
+				folded++;
+				continue;
+			}
+			if (!client->agg_stalled) {
+				trk_thread_agg_flush(client);
+				if (client->nodes->agg(client->agg, items + i, f->agg_func) == TRACKD_OK) {
+					folded++;
+					continue;
+				}
+				client->agg_stalled = 1;
+			}
+			if (trk_thread_putback(me, f, items + i) != TRACKD_OK) {
+				__sync_fetch_and_add(&g_running->discarded, 1);
+			}
+		}
+		__sync_fetch_and_add(&g_running->agg_events, folded);
+		return;
+	}
+
+	/* the latest of every key, written out by the flush timer */
+	if (client->coalesce) {
+		for (i = 0; i < n; i++) {
+			int r = coalesce_put(client->coalesce, items + i);
+			if (r == -1) {
+				trk_thread_coalesce_flush(client);
+				r = coalesce_put(client->coalesce, items + i);
+			}
+			/* full: the size threshold */
+			if (r == 1) {
+				trk_thread_coalesce_flush(client);
+			}
+		}
+		__sync_fetch_and_add(&g_running->coalesce_events, n);
+		return;
+	}
+
+	trk_thread_write_run(me, f, client, items, n);
+}
+
+
+/**
+ * write n items of one op: in one go if the node takes batches, the
+ * items it did not write then fail over one by one like
+ * trk_thread_process(), those it dropped are not tried again
+ */
+static void trk_thread_write_run(struct trk_thread *me, struct func *f,
+		struct trk_sink_client *client, struct trk_item *items, size_t n)
+{
+	struct trk_client_node *node = NULL;
+	int rets[TRK_DRAIN_BATCH];
+	int try_times;
+	size_t i;
+
+	/* the nodes of a client share a sink type */
+	if (client->nodes->proc_batch == NULL || n == 1) {
+		for (i = 0; i < n; i++) {
+			trk_thread_process(me, items + i);
+		}
+		return;
+	}
+
+	for (try_times = 0; node == NULL && try_times < client->num_clients; try_times++) {
+		node = next_client_node(f, client);
+	}
+	/* every node failed lately, as trk_thread_process() would find */
+	if (node == NULL) {
+		return;
+	}
+
+	if (node->proc_batch(node, items, n, rets) == TRACKD_OK) {
+		node->last_err_time = 0;
+	} else {
+		node->last_err_time = time(NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (rets[i] == TRK_ITEM_DROP) {
+			__sync_fetch_and_add(&g_running->discarded, 1);
+		} else if (rets[i] != TRACKD_OK) {
+			trk_thread_process(me, items + i);
+		}
+	}
 }
 
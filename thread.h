@@ -31,15 +31,104 @@
 #define __THREAD_H__
 
 #include "trackd.h"
+#include "agg.h"
+#include "coalesce.h"
+#include "resp.h"
 
 #include <event.h>
+#include <pthread.h>
+#include <time.h>
+
+extern struct settings *g_settings;
+
+/* aggregation defaults, "agg_slots" in [op_func_N_option] */
+#define TRK_AGG_SLOTS      4096
+
+/* coalescing defaults, "coalesce_max" and "coalesce_by" in [op_func_N_option] */
+#define TRK_COALESCE_MAX   1024
+#define TRK_COALESCE_BY    "date"
+
+/* async redis nodes, "redis_max_inflight" and "redis_timeout_ms" in [op_func_N_option] */
+#define TRK_REDIS_MAX_INFLIGHT 1024
+#define TRK_REDIS_TIMEOUT_MS   1000  /* a node that answers nothing that long is dropped */
+
+/* mysql sinks, "mysql_table" and "mysql_timeout" in [op_func_N_option] */
+#define TRK_MYSQL_TABLE "T_Zhixin_Stat"
+#define TRK_MYSQL_TIMEOUT 10  /* sec, a read or write stuck that long drops the connection */
 
 /* ignore time(sec) when error occur */
 //如果client在最近2秒内发生过错误，则跳过，选取其他的client
 #define TRK_ERR_IGNORE_TIME 2
 
-/* pool's capacity, MUST less than pipe's max size 64K(65536) */
-#define TRK_POOL_CAPACITY  10240
+/* default size of a lane's pool in bytes, "pool_bytes" in [trackd], per lane not per worker */
+#define TRK_POOL_BYTES     (4 << 20)
+
+/* pool cell, a trk item takes as many cells as its query string needs */
+#define TRK_POOL_CELL      64
+
+/* items popped per pool_pop_batch() while draining */
+#define TRK_DRAIN_BATCH    64
+
+/* spill defaults, "spill_max_mb" and "spill_segment_mb" in [trackd] */
+#define TRK_SPILL_MAX_MB      1024
+#define TRK_SPILL_SEGMENT_MB  64
+
+/* execution model, "mode" in [trackd] */
+#define TRK_MODE_PIPELINE      0  /* listeners -> pools -> workers */
+#define TRK_MODE_PER_CORE      1  /* a worker per core serves its own sockets, no pools */
+
+/* how events are spread over workers, "dispatch" in [trackd] */
+#define TRK_DISPATCH_RR        0  /* round robin */
+#define TRK_DISPATCH_AFFINITY  1  /* by (op, trk_id), see route.h */
+#define TRK_DISPATCH_P2C       2  /* the less loaded of two random workers */
+
+/* affinity rebalancing, "rebalance_interval" (sec) in [trackd], 0 to disable */
+#define TRK_REBALANCE_INTERVAL 5
+#define TRK_REBALANCE_MOVES    8   /* buckets moved per pass, at most */
+
+/* how an idle worker waits, "worker_mode" in [trackd] */
+#define TRK_WORKER_BLOCK       0  /* in event_base_loop(), woken by notify */
+#define TRK_WORKER_BUSYPOLL    1  /* spin, then yield, then block */
+
+/* busypoll defaults, "busypoll_spin_us", "busypoll_yield_us" and
+ * "busy_poll_us" (SO_BUSY_POLL) in [trackd] */
+#define TRK_BUSYPOLL_SPIN_US   50
+#define TRK_BUSYPOLL_YIELD_US  1000
+#define TRK_BUSY_POLL_US       50
+
+/* autoscaling, "min_worker_threads", "max_worker_threads" and
+ * "autoscale_interval" (sec) in [trackd] */
+#define TRK_AUTOSCALE_INTERVAL   5
+#define TRK_SCALE_UP_OCCUPANCY   25  /* % of the active workers' pools, or */
+#define TRK_SCALE_UP_LOAD        80  /* % of their time spent sinking */
+#define TRK_SCALE_DOWN_OCCUPANCY 1
+#define TRK_SCALE_UP_TICKS       3   /* intervals in a row */
+#define TRK_SCALE_DOWN_TICKS     12
+#define TRK_RETIRE_GRACE_MS      100 /* drain check of a retiring worker */
+
+/* work stealing, "work_stealing" in [trackd] */
+#define TRK_STEAL_INTERVAL_MS  10
+#define TRK_STEAL_MIN_BYTES    (16 << 10)  /* backlog of a victim, at least */
+#define TRK_STEAL_BATCHES      16          /* per tick, TRK_DRAIN_BATCH items each */
+
+/* items a lane of weight 1 may drain per round */
+#define TRK_LANE_QUANTUM   16
+
+/* batches replayed from the spill per wakeup, then the pool goes first again */
+#define TRK_SPILL_REPLAY_BATCHES 16
+
+/* wal defaults, "wal_sync_ms" and "wal_segment_mb" in [trackd] */
+#define TRK_WAL_SYNC_MS       100
+#define TRK_WAL_SEGMENT_MB    16
+
+/*
+ * what proc and the rets of proc_batch give for an item besides
+ * TRACKD_OK and TRACKD_ERR (not written, tried on the op's next node):
+ * refused by the server or failed after some of it was applied, it is
+ * dropped. A node is failed over only when proc or proc_batch gives
+ * TRACKD_ERR
+ */
+#define TRK_ITEM_DROP 1
 
 struct trk_client_node{
 	void		*conn;
@@ -52,9 +141,24 @@ struct trk_client_node{
 	const char	*db;
 	
 	int (*proc)(void* n,void* item);
+	/* optional, a run of items of one op at once, rets[i] of each */
+	int (*proc_batch)(void* n, void* items, size_t count, int* rets);
+	/* optional, aggregation of items and the write out, see agg.h */
+	int (*agg)(struct agg *a, void* item, int func);
+	int (*agg_flush)(void* n, struct agg_entry *entries, size_t count);
 	int (*finalizer)(void* n);
 
 	time_t	last_err_time;   /* last err occur time, 0 for no err */
+
+	char	script_sha[41];  /* redis: the rollup script, "" if not loaded */
+	struct resp_buf obuf;    /* redis: commands, reused from batch to batch */
+	struct resp_buf ibuf;    /* redis: replies of a blocking node */
+
+	/* conn is on the worker's event loop, proc only sends */
+	int	async;
+	int	inflight;        /* commands sent, replies not in yet */
+	int	max_inflight;    /* the op stops draining at this, 0 no limit */
+	int	timeout_ms;      /* replies due that long drop the connection */
 };
 
 struct trk_sink_client {
@@ -64,23 +168,87 @@ struct trk_sink_client {
 	int op;
 	int          num_clients;
 	unsigned int client_idx;
+
+	struct trk_thread *thread;  /* owner */
+
+	/* buffers of the op on this worker, NULL if not configured */
+	struct agg      *agg;       /* agg_window_ms */
+	struct coalesce *coalesce;  /* coalesce_ms */
+	struct event flush_event;   /* flush timer of either */
+	unsigned int flush_seed;    /* of the flush jitter */
+	int agg_stalled;            /* agg full after a flush, lane held until the timer */
 };
 
 
+/*
+ * every op has its own lane in each worker: lanes of a higher priority
+ * are drained first, lanes of the same priority share the worker by
+ * weight (deficit round robin, in items)
+ */
+struct trk_lane {
+	struct pool *pool;
+	int priority;
+	int weight;
+	int deficit;           /* items left in this round, worker only */
+
+	/* queueing delay, written by the worker */
+	uint64_t wait_us_avg;  /* ewma */
+	uint64_t wait_us_max;  /* since the last /_status */
+};
+
 struct trk_thread {
 	struct event_base *base;    /* libevent handle this thread uses */
-	struct event notify_event;  /* listen event for notify pipe */
-	int notify_receive_fd;      /* receiving end of notify pipe */
-	int notify_send_fd;         /* sending end of notify pipe   */
+	struct event notify_event;  /* listen event for notify fd */
+	struct event steal_event;   /* work stealing timer */
+	struct event retire_event;  /* drain check while retiring */
+	int notify_receive_fd;      /* eventfd, or receiving end of notify pipe */
+	int notify_send_fd;         /* eventfd, or sending end of notify pipe   */
+
+	int idx;                    /* in threads */
+	pthread_t tid;
+	int running;                /* in its loop, under init_lock */
+	int retire;                 /* 1 asked to retire, 2 draining */
+	uint64_t busy_us;           /* time spent sinking, worker only */
+	struct trk_lane *lanes;     /* settings->num_lanes */
+	struct trk_item *batch;     /* TRK_DRAIN_BATCH items, worker only */
+	struct trk_thread *batch_from; /* whose wal the batch is acked in, worker only */
+	int batch_len;              /* bytes of a batch item */
+	struct spill *spill;        /* overflow of pool, NULL if disabled */
+	struct wal *wal;            /* log of accepted items, NULL if disabled */
+	struct event udp_event;     /* own udp socket, per_core only */
+	struct evhtp_s *htp;        /* own http server, per_core only */
+
+	/* 1 while a wakeup is pending, producers only signal on 0->1 */
+	int notify_pending __attribute__((aligned(64)));
+	int polling;                /* busypoll: spinning on notify_pending, no signal needed */
+	int accepting;              /* producers may queue to us, cleared to retire */
+	int pushing;                /* producers between enter and leave */
+	int sink_blocked;           /* a lane stopped on a full async node, worker only */
+	uint64_t notify_us;         /* when notify_pending was last set, by who set it */
 
-	struct pool *pool;          /* buffer pool */
+	/* wakeup latency, notify to drain, written by the worker */
+	uint64_t wake_us_avg __attribute__((aligned(64)));  /* ewma */
+	uint64_t woken_us;          /* when the last wakeup began */
+	uint64_t wake_us_max;       /* since the last /_status */
 
-	struct trk_sink_client *trk_r_clients[DDTRACK_OP_MAX];/* */
+	struct trk_sink_client **trk_r_clients; /* indexed by op, num_op_funcs */
+
+	uint32_t *route_hits;       /* events per route bucket, affinity only */
 };
 
 
 
-int trk_thread_init(int trk_msg_len);
+/* called by every worker before its loop, on its own thread */
+typedef void (*trk_thread_attach_cb)(struct trk_thread *me);
+
+/* attach may be NULL */
+int trk_thread_init(int trk_msg_len, trk_thread_attach_cb attach);
+
+/* the worker running the calling thread, NULL off the workers */
+extern __thread struct trk_thread *trk_thread_self;
+
+/* sink an item right away on the calling worker, per_core mode */
+void trk_thread_sink(struct trk_thread *me, struct trk_item *item);
 
 int trk_thread_setup(struct trk_thread *me,
 				int trk_msg_len, 
@@ -88,4 +256,52 @@ int trk_thread_setup(struct trk_thread *me,
 
 struct trk_thread *trk_thread_choose_one(int idx);
 
+/* workers [0, trk_thread_active()) take events */
+int trk_thread_active(void);
+
+/*
+ * sink an item an async node failed again, on the calling worker; its
+ * lsn is in the wal of from, acked once sunk or given up
+ */
+void trk_thread_resink(struct trk_item *item, struct trk_thread *from);
+
+/* an async node took replies, drain again if it was holding the lanes */
+void trk_thread_sink_ready(void);
+
+/*
+ * producers: TRACKD_OK if t takes events, then queue to it (wal, pool,
+ * spill) and trk_thread_leave(); TRACKD_ERR if it is retiring, pick again
+ */
+int trk_thread_enter(struct trk_thread *t);
+void trk_thread_leave(struct trk_thread *t);
+
+/* set once trk_thread_shutdown() began, producers turned away drop */
+int trk_thread_stopping(void);
+
+/* drain and stop every worker, then free them; off the worker threads */
+void trk_thread_shutdown(void);
+
+/* wake up the worker after pushing to its pool, cheap if already woken */
+void trk_thread_notify(struct trk_thread *t);
+
+/* the worker owning (op, trk_id), affinity dispatch only */
+struct trk_thread *trk_thread_route(uint32_t op, uint64_t trk_id);
+
+/* bytes queued in all lanes of a worker */
+size_t trk_thread_pool_size(struct trk_thread *t);
+
+/* the lane of op, NULL if op is not configured */
+static inline struct trk_lane *trk_thread_lane(struct trk_thread *t, long long op)
+{
+	struct func *f = op_func_get(g_settings, op);
+	return f ? &t->lanes[f->lane] : NULL;
+}
+
+static inline uint64_t trk_clock_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #endif
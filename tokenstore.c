@@ -0,0 +1,307 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tokenstore.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HMAC_STATE_LEN (sizeof(uint32_t) * 16)
+#define ALIGN8(n) (((n) + 7) & ~((size_t)7))
+
+struct token_store {
+	void   *image;
+	size_t  size;
+	int     mapped;      /* image is mmap'd, otherwise malloc'd */
+
+	const struct tokenfile_header *header;
+	const struct tokenfile_slot   *slots;
+	const char                    *blob;
+	uint64_t mask;
+};
+
+static inline uint64_t token_hash(uint64_t x);
+static struct token_store *token_store_attach(void *image, size_t size, int mapped);
+
+
+static inline uint64_t token_hash(uint64_t x)
+{
+	/* splitmix64 finalizer */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+
+void *token_image_build(const struct token_entry *entries, size_t n,
+		int with_hmac, size_t *size)
+{
+	uint64_t nslots = 16;
+	while (nslots < n * 2) { nslots <<= 1; }
+
+	size_t i;
+	size_t blob_len = 8; /* offset 0 means empty slot */
+	for (i = 0; i < n; i++) {
+		blob_len += ALIGN8((with_hmac ? HMAC_STATE_LEN : 0) +
+				strlen(entries[i].token) + 1);
+	}
+	if (blob_len > UINT32_MAX) {
+		return NULL;
+	}
+
+	size_t blob_off = sizeof(struct tokenfile_header) +
+		nslots * sizeof(struct tokenfile_slot);
+	size_t total = blob_off + blob_len;
+
+	char *image = calloc(1, total);
+	if (!image) {
+		return NULL;
+	}
+
+	struct tokenfile_header *h = (struct tokenfile_header *)image;
+	struct tokenfile_slot *slots = (struct tokenfile_slot *)(h + 1);
+	char *blob = image + blob_off;
+
+	memcpy(h->magic, TOKENFILE_MAGIC, 4);
+	h->version  = TOKENFILE_VERSION;
+	h->flags    = with_hmac ? TOKENFILE_HMAC : 0;
+	h->nslots   = nslots;
+	h->blob_off = blob_off;
+
+	size_t off = 8;
+	for (i = 0; i < n; i++) {
+		uint64_t id = entries[i].trk_id;
+		uint64_t idx = token_hash(id) & (nslots - 1);
+		while (slots[idx].off != 0 && slots[idx].trk_id != id) {
+			idx = (idx + 1) & (nslots - 1);
+		}
+		if (slots[idx].off != 0) {
+			continue; /* duplicate, first one wins */
+		}
+
+		size_t len = strlen(entries[i].token);
+		char *rec = blob + off;
+		if (with_hmac) {
+			struct hmac_sha256_key k;
+			hmac_sha256_key_init(&k, entries[i].token, len);
+			memcpy(rec, k.inner.state, HMAC_STATE_LEN / 2);
+			memcpy(rec + HMAC_STATE_LEN / 2, k.outer.state, HMAC_STATE_LEN / 2);
+			rec += HMAC_STATE_LEN;
+		}
+		memcpy(rec, entries[i].token, len + 1);
+
+		slots[idx].trk_id = id;
+		slots[idx].off    = (uint32_t)off;
+		slots[idx].len    = (uint32_t)len;
+
+		off += ALIGN8((with_hmac ? HMAC_STATE_LEN : 0) + len + 1);
+		h->count++;
+	}
+
+	h->size = total;
+	*size = total;
+	return image;
+}
+
+
+struct token_store *token_store_new(const struct token_entry *entries,
+		size_t n, int with_hmac)
+{
+	size_t size;
+	void *image = token_image_build(entries, n, with_hmac, &size);
+	if (!image) {
+		return NULL;
+	}
+
+	struct token_store *s = token_store_attach(image, size, 0);
+	if (!s) {
+		free(image);
+	}
+	return s;
+}
+
+
+/**
+ * mmap a token file, nothing is parsed or copied,
+ * pages are faulted in by lookups
+ */
+struct token_store *token_store_open(const char *file)
+{
+	assert(file);
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct tokenfile_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct token_store *s = token_store_attach(image, st.st_size, 1);
+	if (!s) {
+		munmap(image, st.st_size);
+	}
+	return s;
+}
+
+
+static struct token_store *token_store_attach(void *image, size_t size, int mapped)
+{
+	const struct tokenfile_header *h = image;
+
+	/* nslots bounded by the size first, blob_off can't overflow then */
+	if (size < sizeof(struct tokenfile_header) ||
+			memcmp(h->magic, TOKENFILE_MAGIC, 4) != 0 ||
+			h->version != TOKENFILE_VERSION ||
+			h->size != size ||
+			h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0 ||
+			h->nslots > size / sizeof(struct tokenfile_slot) ||
+			h->count > h->nslots ||
+			h->blob_off != sizeof(struct tokenfile_header) +
+				h->nslots * sizeof(struct tokenfile_slot) ||
+			h->blob_off > size) {
+		return NULL;
+	}
+
+	struct token_store *s = calloc(1, sizeof(struct token_store));
+	if (!s) {
+		return NULL;
+	}
+
+	s->image  = image;
+	s->size   = size;
+	s->mapped = mapped;
+	s->header = h;
+	s->slots  = (const struct tokenfile_slot *)(h + 1);
+	s->blob   = (const char *)image + h->blob_off;
+	s->mask   = h->nslots - 1;
+
+	return s;
+}
+
+
+void token_store_free(struct token_store *s)
+{
+	if (s == NULL) {
+		return;
+	}
+
+	if (s->mapped) {
+		munmap(s->image, s->size);
+	} else {
+		free(s->image);
+	}
+	free(s);
+}
+
+
+size_t token_store_count(const struct token_store *s)
+{
+	return s ? s->header->count : 0;
+}
+
+
+int token_store_has_hmac(const struct token_store *s)
+{
+	return s && (s->header->flags & TOKENFILE_HMAC);
+}
+
+
+int token_store_get(const struct token_store *s, uint64_t trk_id,
+		struct token_item *out)
+{
+	if (s == NULL) {
+		return TRACKD_ERR;
+	}
+
+	uint64_t id  = trk_id;
+	uint64_t idx = token_hash(id) & s->mask;
+	const struct tokenfile_slot *slot;
+	size_t hmac_len = token_store_has_hmac(s) ? HMAC_STATE_LEN : 0;
+	size_t blob_size = s->size - s->header->blob_off;
+	uint64_t probes;
+
+	/* a file with no empty slot ends the probe too */
+	for (probes = 0; ; probes++) {
+		if (probes > s->mask) {
+			return TRACKD_ERR;
+		}
+		slot = s->slots + idx;
+		if (slot->off == 0) {
+			return TRACKD_ERR;  /* not found */
+		}
+		if (slot->trk_id == id) {
+			break;
+		}
+		idx = (idx + 1) & s->mask;
+	}
+
+	/* never trust a file more than its size, nor its tokens to end */
+	if (slot->off >= blob_size || hmac_len >= blob_size - slot->off ||
+			slot->len >= blob_size - slot->off - hmac_len) {
+		return TRACKD_ERR;
+	}
+
+	const char *rec = s->blob + slot->off;
+	if (rec[hmac_len + slot->len] != '\0') {
+		return TRACKD_ERR;
+	}
+
+	out->trk_id = trk_id;
+	out->token  = rec + hmac_len;
+	out->hkey   = NULL;
+
+	if (hmac_len) {
+		memcpy(out->hkey_buf.inner.state, rec, HMAC_STATE_LEN / 2);
+		memcpy(out->hkey_buf.outer.state, rec + HMAC_STATE_LEN / 2, HMAC_STATE_LEN / 2);
+		out->hkey_buf.inner.count = SHA256_BLOCK_LEN;
+		out->hkey_buf.outer.count = SHA256_BLOCK_LEN;
+		out->hkey = &out->hkey_buf;
+	}
+
+	return TRACKD_OK;
+}
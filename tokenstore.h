@@ -0,0 +1,115 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TOKENSTORE_H__
+#define __TOKENSTORE_H__
+
+#include "trackd.h"
+#include "sha256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ -------------------------------------------------------------------------------
+ token image
+ -------------------------------------------------------------------------------
+ A token store is one flat image, either built in memory from the
+ [op_func_N_token] group or mmap'd from a file built by tulipa-tokentool:
+
+   header | slots[nslots] | blob
+
+ slots is an open-addressing (linear probe) table keyed by trk_id,
+ load factor <= 0.5. slot.off points into blob, 0 marks an empty slot.
+ A blob record is:
+
+   [uint32 inner[8], uint32 outer[8]]   only if TOKENFILE_HMAC
+   token chars, '\0'
+
+ records are 8-byte aligned.
+*/
+#define TOKENFILE_MAGIC   "TLTK"
+#define TOKENFILE_VERSION 1
+#define TOKENFILE_HMAC    0x1  /* records carry hmac-sha256 ipad/opad states */
+
+struct tokenfile_header {
+	char     magic[4];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t nslots;   /* power of 2 */
+	uint64_t count;
+	uint64_t blob_off;
+	uint64_t size;     /* size of the whole image */
+};
+
+struct tokenfile_slot {
+	uint64_t trk_id;
+	uint32_t off;      /* record offset in blob, 0 for empty */
+	uint32_t len;      /* token length */
+};
+
+struct token_entry {
+	uint64_t trk_id;
+	const char *token;
+};
+
+/* result of a lookup */
+struct token_item {
+	uint64_t trk_id;
+	const char *token;
+	const struct hmac_sha256_key *hkey;   /* NULL unless the store has hmac */
+	struct hmac_sha256_key hkey_buf;
+};
+
+struct token_store;
+
+/**
+ * build an image from entries, first one wins on duplicate trk_id
+ * @return malloc'd image, NULL on failure
+ */
+void *token_image_build(const struct token_entry *entries, size_t n,
+		int with_hmac, size_t *size);
+
+struct token_store *token_store_new (const struct token_entry *entries,
+		size_t n, int with_hmac);
+struct token_store *token_store_open(const char *file);
+void token_store_free(struct token_store *s);
+
+size_t token_store_count(const struct token_store *s);
+int    token_store_has_hmac(const struct token_store *s);
+
+/**
+ * O(1) lookup, fills *out (hkey points into *out)
+ * If found, return TRACKD_OK
+ */
+int token_store_get(const struct token_store *s, uint64_t trk_id,
+		struct token_item *out);
+
+#endif
@@ -0,0 +1,160 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tulipa-tokentool: build a token file for "token_file" in [op_func_N_option]
+ *
+ * input is one token per line, "trk_id = token" or "trk_id token",
+ * lines starting with ';' or '#' and [group] lines are ignored,
+ * so an existing [op_func_N_token] group can be fed as is.
+ */
+
+#include "tokenstore.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void print_help()
+{
+	const static char *h = "tulipa-tokentool - build token file for Tulipa.\n"
+		"Options:\n"
+		"\t-i <tokens.txt> input file, default stdin\n"
+		"\t-o <tokens.bin> output file\n"
+		"\t-s precompute hmac-sha256 states, needed by sign_v2 ops\n"
+		"\t-h print help\n"
+		"Usage:\n"
+		"\t./tulipa-tokentool -s -i tokens.txt -o tokens.bin\n"
+		;
+	fprintf(stdout, "%s", h);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *input = NULL, *output = NULL;
+	int with_hmac = 0;
+	int optchr;
+
+	while ((optchr = getopt(argc, argv, "i:o:sh")) != -1) {
+		switch (optchr) {
+			case 'i':
+				input = optarg;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 's':
+				with_hmac = 1;
+				break;
+			case 'h':
+			default:
+				print_help();
+				exit(1);
+		}
+	}
+	if (output == NULL) {
+		print_help();
+		exit(1);
+	}
+
+	FILE *in = input ? fopen(input, "r") : stdin;
+	if (!in) {
+		fprintf(stderr, "open %s failure\n", input);
+		exit(1);
+	}
+
+	size_t n = 0, cap = 1024;
+	struct token_entry *entries = malloc(cap * sizeof(struct token_entry));
+	char line[8192];
+	int line_num = 0;
+
+	while (entries && fgets(line, sizeof(line), in)) {
+		line_num++;
+
+		char *p = line;
+		while (isspace(*p)) { p++; }
+		if (*p == '\0' || *p == ';' || *p == '#' || *p == '[') {
+			continue;
+		}
+
+		/* trk_id */
+		char *end;
+		errno = 0;
+		unsigned long long trk_id = strtoull(p, &end, 10);
+		if (end == p || *p == '-' || errno == ERANGE) {
+			fprintf(stderr, "line %d: bad trk_id, skipped\n", line_num);
+			continue;
+		}
+
+		/* token */
+		p = end;
+		while (isspace(*p) || *p == '=') { p++; }
+		end = p + strlen(p);
+		while (end > p && isspace(*(end - 1))) { end--; }
+		if (end == p) {
+			fprintf(stderr, "line %d: no token, skipped\n", line_num);
+			continue;
+		}
+		*end = '\0';
+
+		if (n == cap) {
+			entries = realloc(entries, (cap *= 2) * sizeof(struct token_entry));
+			if (!entries) break;
+		}
+		entries[n].trk_id = trk_id;
+		entries[n].token  = strdup(p);
+		if (!entries[n].token) break;
+		n++;
+	}
+	if (in != stdin) fclose(in);
+
+	size_t size;
+	void *image = entries ? token_image_build(entries, n, with_hmac, &size) : NULL;
+	if (!image) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* write to a temp file then rename, a running trackd may have it mapped */
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+	FILE *out = fopen(tmp, "wb");
+	if (!out || fwrite(image, 1, size, out) != size || fclose(out) != 0 ||
+			rename(tmp, output) != 0) {
+		fprintf(stderr, "write %s failure\n", output);
+		exit(1);
+	}
+
+	fprintf(stdout, "%zu tokens, %zu bytes written to %s\n",
+			(size_t)((struct tokenfile_header *)image)->count, size, output);
+	return 0;
+}
@@ -0,0 +1,131 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "topology.h"
+#include "trackd.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+int topology_parse(const char *s, struct cpu_list *l)
+{
+	const char *p = s;
+
+	l->n = 0;
+	while (*p) {
+		char *end;
+		long lo, hi;
+
+		while (isspace((unsigned char)*p) || *p == ',') p++;
+		if (*p == '\0') {
+			break;
+		}
+
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0) {
+			return TRACKD_ERR;
+		}
+		hi = lo;
+		p = end;
+		if (*p == '-') {
+			hi = strtol(p + 1, &end, 10);
+			if (end == p + 1 || hi < lo) {
+				return TRACKD_ERR;
+			}
+			p = end;
+		}
+		if (*p && *p != ',' && !isspace((unsigned char)*p)) {
+			return TRACKD_ERR;
+		}
+
+		for (; lo <= hi; lo++) {
+			if (l->n == TOPOLOGY_MAX_CPUS || lo >= CPU_SETSIZE) {
+				return TRACKD_ERR;
+			}
+			l->cpus[l->n++] = lo;
+		}
+	}
+	return l->n > 0 ? TRACKD_OK : TRACKD_ERR;
+}
+
+
+int topology_pin(const struct cpu_list *l)
+{
+	cpu_set_t set;
+	int i;
+
+	if (l == NULL) {
+		return TRACKD_OK;
+	}
+	CPU_ZERO(&set);
+	for (i = 0; i < l->n; i++) {
+		CPU_SET(l->cpus[i], &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ?
+		TRACKD_OK : TRACKD_ERR;
+}
+
+
+int topology_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ?
+		TRACKD_OK : TRACKD_ERR;
+}
+
+
+int topology_cpu_node(int cpu)
+{
+	char path[64];
+	DIR *d;
+	struct dirent *de;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	d = opendir(path);
+	if (d == NULL) {
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (sscanf(de->d_name, "node%d", &node) == 1) {
+			break;
+		}
+	}
+	closedir(d);
+	return node;
+}
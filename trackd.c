@@ -31,16 +31,23 @@
 #include "thread.h"
 #include "trackd.h"
 #include "util.h"
-#include "md5.h"
-#include "sha1.h"
+#include "sign.h"
+#include "tokenstore.h"
 #include "log.h"
 #include "pool.h"
+#include "spill.h"
+#include "wal.h"
+#include "topology.h"
+#include "agg.h"
+#include "mysqljob.h"
 
 #include <assert.h>
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -64,11 +71,19 @@
    Function Defination
    -------------------------------------------------------------------------------
    */
-static int create_udp_server_socket(const char *host, int port);
+static int create_udp_server_socket(const char *host, int port, int reuseport);
+static int create_tcp_server_socket(const char *host, int port);
+static void set_busy_poll(int fd);
+static evhtp_t *htp_setup(evbase_t *evbase);
+static void per_core_attach(struct trk_thread *me);
 static void libevent_cb_udp_recv(int fd, short which, void *arg);
 
 static int config_init(const char *config_file, struct inifile **ini);
 static int settings_init(struct settings **settings, struct inifile *ini);
+static int settings_init_tokens(struct func *f, struct inifile *ini);
+static int settings_init_lanes(struct settings *settings);
+static int settings_init_rollup(struct func *f, const char *rollup);
+static struct cpu_list *settings_cpu_list(struct inifile *ini, const char *key);
 static int running_init(struct running **running);
 static void parse_arguments(int argc, char *argv[]);
 static void print_help();
@@ -76,7 +91,7 @@ static void print_help();
 static void create_reset_counter();
 static void *reset_counter(void *arg);
 
-static struct trk_thread *pickup_trk_thread();
+static struct trk_thread *pickup_trk_thread(const struct trk_item *trkitem);
 static inline void push_ele_to_pool(struct trk_item *trkitem);
 
 static void *listener_udp(void *arg);
@@ -96,7 +111,7 @@ static void worker_run();
 
 static void shutdown_server();
 static void sigtermHandler(int sig);
-static void sigtermHandlerChild(int sig);
+static void worker_shutdown();
 static void settings_free(struct settings *settings);
 /*
    -------------------------------------------------------------------------------
@@ -206,26 +221,34 @@ int main (int argc, char * argv[])
 static void worker_run()
 {
 	trackdLog(TRACKD_DEBUG,"new Trackd Worker started,pid:%d",getpid());
-	setupSignalHandlers(sigtermHandlerChild);
+	setupSignalHandlers(SIG_DFL);
 
-	trk_thread_init(sizeof(struct trk_item));
+	/*
+	 * SIGTERM is blocked in every thread, they inherit it from here:
+	 * this thread waits for it and shuts down outside of any handler
+	 */
+	sigset_t term;
+	int sig;
+	sigemptyset(&term);
+	sigaddset(&term, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &term, NULL);
+
+	trk_thread_init(sizeof(struct trk_item),
+			g_settings->mode == TRK_MODE_PER_CORE ? per_core_attach : NULL);
 
 	// Creates a thread for reset counter
 	create_reset_counter();
 
-	pthread_t threads[2];
-
-	run_udp(&threads[0]);
-	run_tcp(&threads[1]);
+	/* per_core: the workers serve their own sockets, nothing else to run */
+	if (g_settings->mode == TRK_MODE_PIPELINE) {
+		pthread_t threads[2];
 
-	int i = 0;
-	for (; i < sizeof(threads)/sizeof(threads[0]); ++i) {
-		pthread_join(threads[i], NULL);
+		run_udp(&threads[0]);
+		run_tcp(&threads[1]);
 	}
 
-	mysql_library_end();
-
-	trackdLog(TRACKD_DEBUG,"Trackd Worker exit,pid:%d",getpid());
+	while (sigwait(&term, &sig) != 0 || sig != SIGTERM);
+	worker_shutdown();
 }
 
 
@@ -251,6 +274,8 @@ static void *listener_udp(void *arg)
 	struct event udp_event;
 	struct event_base *main_base;
 
+	topology_pin(g_settings->udp_cpus);
+
 	main_base = event_init();
 	if (!main_base) {
 		fprintf(stderr, "can't allocate event base\n");
@@ -258,7 +283,7 @@ static void *listener_udp(void *arg)
 	}
 
 	int trk_udpser_shd = create_udp_server_socket(g_settings->host,
-			g_settings->port);
+			g_settings->port, 0);
 	if (trk_udpser_shd == -1) {
 		fprintf(stderr, "can't create udp server socket\n");
 		exit(1);
@@ -276,6 +301,32 @@ static void *listener_udp(void *arg)
 }
 
 
+/**
+ * per_core mode: a worker gets its own SO_REUSEPORT udp and http
+ * sockets on its own event base, the kernel spreads the traffic
+ */
+static void per_core_attach(struct trk_thread *me)
+{
+	int udp_fd = create_udp_server_socket(g_settings->host, g_settings->port, 1);
+	int tcp_fd = create_tcp_server_socket(g_settings->host, g_settings->port);
+	if (udp_fd == -1 || tcp_fd == -1) {
+		fprintf(stderr, "can't create reuseport sockets of worker %d\n", me->idx);
+		exit(1);
+	}
+
+	event_set(&me->udp_event, udp_fd,
+			EV_READ | EV_PERSIST, libevent_cb_udp_recv, NULL);
+	event_base_set(me->base, &me->udp_event);
+	event_add(&me->udp_event, NULL);
+
+	me->htp = htp_setup(me->base);
+	if (evhtp_accept_socket(me->htp, tcp_fd, 1024) != 0) {
+		fprintf(stderr, "can't listen http of worker %d\n", me->idx);
+		exit(1);
+	}
+}
+
+
 /*
    -------------------------------------------------------------------------------
    TCP HTTP
@@ -296,6 +347,8 @@ static void run_tcp(pthread_t *thread)
 
 static evhtp_res htpcb_pre(evhtp_connection_t *req, void *arg)
 {
+	set_busy_poll(req->sock);
+
 	__sync_fetch_and_add(&g_running->today_req_num, 1);
 	__sync_fetch_and_add(&g_running->total_req_num, 1);
 	//g_running->today_req_num += 1;
@@ -316,7 +369,7 @@ static void htp_add_common_headers(evhtp_request_t *req)
 static int verify_request_arg(evhtp_request_t *req,struct trk_item *trk_item)
 {
 	/* find http key */
-	const char *q_op, *q_date, *q_data, *q_trk_id, *q_salt, *p;
+	const char *q_op, *q_date, *q_data, *q_trk_id, *q_salt;
 
 	q_op     = evhtp_kv_find(req->uri->query, "op");
 	q_date   = evhtp_kv_find(req->uri->query, "date");
@@ -331,10 +384,12 @@ static int verify_request_arg(evhtp_request_t *req,struct trk_item *trk_item)
 	}
 
 	/* check op */
-	int op = atoi(q_op);
-	if (op < 0 || op >= DDTRACK_OP_MAX) {
+	uint64_t op;
+	struct func *f;
+	if (parse_uint64(q_op, &op) != TRACKD_OK ||
+			(f = op_func_get(g_settings, op)) == NULL) {
 		evbuffer_add_printf(req->buffer_out, "%d\top must in [0, %d)",
-				HTP_OP_ERR, DDTRACK_OP_MAX);
+				HTP_OP_ERR, g_settings->num_op_funcs);
 		return TRACKD_ERR;
 	}
 
@@ -355,49 +410,24 @@ static int verify_request_arg(evhtp_request_t *req,struct trk_item *trk_item)
 	}
 
 	/* check track id */
-	p = q_trk_id;
-	while (isdigit(*p)) { p++; }
-	if (*p != '\0') {
+	uint64_t trk_id;
+	if (parse_uint64(q_trk_id, &trk_id) != TRACKD_OK) {
 		evbuffer_add_printf(req->buffer_out, "%d\t%s",
 				HTP_TRK_ID_ERR, "track id error");
 		return TRACKD_ERR;
 	}
-	int trk_id = atoi(q_trk_id);
 	(*trk_item).trk_id = trk_id;
 
-	int data = atoi(q_data);
-
 	/* check salt */
-	const char *token = NULL;
-	get_token(op,trk_id,&token,&g_settings);
-
-	struct dict d[3]; 
-	d[0].p = "trk_id";
-	d[0].v = trk_id;
-
-	d[1].p = "data";
-	d[1].v = data;
-
-	d[2].p = "date";
-	d[2].v = date;
-
-	qsort(d,3,sizeof(struct dict),cmp);
-
-	int written;
-
-	char cryptstr[41];
-
-	written = snprintf((*trk_item).query_str, sizeof((*trk_item).query_str),
-			"%s=%d&%s=%d&%s=%d",
-			d[0].p,d[0].v,d[1].p,d[1].v,d[2].p,d[2].v);
-	md5((*trk_item).query_str,written,cryptstr);
-
-	written = snprintf((*trk_item).query_str,sizeof((*trk_item).query_str),
-			"%s%s",
-			cryptstr,token);
-	sha1((*trk_item).query_str,written,cryptstr);
+	struct token_item token_buf;
+	const struct token_item *token = NULL;
+	if (token_store_get(f->tokens, trk_id, &token_buf) == TRACKD_OK) {
+		token = &token_buf;
+	}
+	int verified = sign_verify(f, token, op,
+			q_trk_id, q_data, q_date, q_salt);
 
-	if (memcmp(cryptstr,q_salt,SHA1_LEN) != 0) {
+	if (verified != TRACKD_OK) {
 		evbuffer_add_printf(req->buffer_out, "%d\t%s",
 				HTP_SALT_ERR, "salt error");
 		return TRACKD_ERR;
@@ -441,21 +471,105 @@ static void htpcb_status(evhtp_request_t *req, void *arg)
 	evbuffer_add_printf(req->buffer_out, "req num: %llu/%llu (today/total)\n",
 			g_running->today_req_num, g_running->total_req_num);
 
-	/* pool size */
 	struct trk_thread *t;
-	int i;
-	size_t total_size     = 0;
-	size_t total_capacity = 0;
-	for (i = 0; i < g_settings->num_worker_threads; ++i) {
-		t = trk_thread_choose_one(i);
-		size_t size = pool_size(t->pool);
-		evbuffer_add_printf(req->buffer_out, "pool[%02d]: %6ld/%6ld (cur/max)\n",
-				i, size, t->pool->capacity);
-		total_size     += size;
-		total_capacity += t->pool->capacity;
-	}
-	evbuffer_add_printf(req->buffer_out, "  ptotal: %6ld/%6ld (cur/max)\n",
-			total_size, total_capacity);
+	int i, j;
+	int n = trk_thread_active();
+
+	if (g_settings->mode == TRK_MODE_PER_CORE) {
+		evbuffer_add_printf(req->buffer_out, "mode: per_core, %d workers\n", n);
+	} else {
+		/* pool size */
+		size_t total_size     = 0;
+		size_t total_capacity = 0;
+		for (i = 0; i < n; ++i) {
+			t = trk_thread_choose_one(i);
+			size_t size = 0, capacity = 0;
+			for (j = 0; j < g_settings->num_lanes; j++) {
+				size     += pool_size(t->lanes[j].pool);
+				capacity += t->lanes[j].pool->bytes;
+			}
+			evbuffer_add_printf(req->buffer_out, "pool[%02d]: %9zu/%9zu bytes (cur/max)\n",
+					i, size, capacity);
+			total_size     += size;
+			total_capacity += capacity;
+		}
+		evbuffer_add_printf(req->buffer_out, "  ptotal: %9zu/%9zu bytes (cur/max)\n",
+				total_size, total_capacity);
+
+		/* lanes, over all workers */
+		for (j = 0; j < g_settings->num_lanes; j++) {
+			struct func *f = g_settings->lanes[j];
+			size_t depth = 0;
+			unsigned long long avg = 0, max = 0;
+			for (i = 0; i < n; ++i) {
+				struct trk_lane *lane = &trk_thread_choose_one(i)->lanes[j];
+				unsigned long long m = __sync_lock_test_and_set(&lane->wait_us_max, 0);
+				depth += pool_size(lane->pool);
+				avg   += lane->wait_us_avg;
+				max    = m > max ? m : max;
+			}
+			evbuffer_add_printf(req->buffer_out,
+					"lane[op %d]: prio %d weight %d, %9zu bytes, wait %llu/%llu us (avg/max)\n",
+					f->op, f->lane_priority, f->lane_weight, depth,
+					avg / n, max);
+		}
+	}
+
+	/* wakeup latency, notify to drain */
+	if (g_settings->mode == TRK_MODE_PIPELINE) {
+		unsigned long long avg = 0, max = 0;
+		for (i = 0; i < n; ++i) {
+			t = trk_thread_choose_one(i);
+			unsigned long long m = __sync_lock_test_and_set(&t->wake_us_max, 0);
+			avg += t->wake_us_avg;
+			max  = m > max ? m : max;
+		}
+		evbuffer_add_printf(req->buffer_out, "wakeup: %llu/%llu us (avg/max), %s\n",
+				avg / n, max,
+				g_settings->worker_mode == TRK_WORKER_BUSYPOLL ? "busypoll" : "block");
+	}
+
+	/* autoscaling */
+	if (g_settings->max_worker_threads > g_settings->min_worker_threads) {
+		evbuffer_add_printf(req->buffer_out,
+				"workers: %d in [%d, %d], %llu/%llu (scale ups/downs)\n",
+				n, g_settings->min_worker_threads, g_settings->max_worker_threads,
+				g_running->scale_ups, g_running->scale_downs);
+	}
+
+	/* verification cache */
+	unsigned long long cache_hits, cache_misses;
+	sign_cache_stats(&cache_hits, &cache_misses);
+	evbuffer_add_printf(req->buffer_out, "sign cache: %llu/%llu (hit/miss)\n",
+			cache_hits, cache_misses);
+
+	/* dispatch */
+	if (g_settings->dispatch == TRK_DISPATCH_AFFINITY) {
+		evbuffer_add_printf(req->buffer_out, "dispatch: affinity, %llu buckets moved\n",
+				g_running->route_moves);
+	} else if (g_settings->dispatch == TRK_DISPATCH_P2C) {
+		evbuffer_add_printf(req->buffer_out, "dispatch: power of two choices\n");
+	} else {
+		evbuffer_add_printf(req->buffer_out, "dispatch: round robin\n");
+	}
+
+	/* work stealing */
+	if (g_settings->work_stealing) {
+		evbuffer_add_printf(req->buffer_out, "steal: %llu/%llu (steals/items)\n",
+				g_running->steals, g_running->stolen);
+	}
+
+	/* aggregation */
+	evbuffer_add_printf(req->buffer_out, "agg: %llu/%llu (events/writes)\n",
+			g_running->agg_events, g_running->agg_writes);
+
+	/* coalescing */
+	evbuffer_add_printf(req->buffer_out, "coalesce: %llu/%llu (events/writes)\n",
+			g_running->coalesce_events, g_running->coalesce_writes);
+
+	/* overflow spill */
+	evbuffer_add_printf(req->buffer_out, "spill: %llu/%llu/%llu (spilled/replayed/discarded)\n",
+			g_running->spilled, g_running->replayed, g_running->discarded);
 
 	/* up time */
 	int up_time = (int)(time(NULL) - g_running->start_time);
@@ -478,9 +592,16 @@ static void htpcb_ison(evhtp_request_t *req, void *arg)
 	evhtp_send_reply(req, EVHTP_RES_OK);
 }
 
-static void *listener_tcp(void *arg)
+static void htp_thread_init(evhtp_t *htp, evthr_t *thr, void *arg)
+{
+	topology_pin(g_settings->http_cpus);
+}
+
+/**
+ * an evhtp on evbase with our callbacks
+ */
+static evhtp_t *htp_setup(evbase_t *evbase)
 {
-	evbase_t *evbase = event_base_new();
 	evhtp_t  *htp    = evhtp_new(evbase, NULL);
 
 	/* set callback func */
@@ -497,8 +618,18 @@ static void *listener_tcp(void *arg)
 	timeo.tv_usec = 500000; // 0.5 sec
 	evhtp_set_timeouts(htp, &timeo, &timeo);             /* set timeout */
 
+	return htp;
+}
+
+static void *listener_tcp(void *arg)
+{
+	topology_pin(g_settings->http_cpus);
+
+	evbase_t *evbase = event_base_new();
+	evhtp_t  *htp    = htp_setup(evbase);
+
 	if (EVHTP_THREAD_NUM > 0) {
-		evhtp_use_threads(htp, NULL, EVHTP_THREAD_NUM, NULL);
+		evhtp_use_threads(htp, htp_thread_init, EVHTP_THREAD_NUM, NULL);
 	}
 	evhtp_bind_socket(htp, g_settings->host, g_settings->port, 1024);
 
@@ -528,7 +659,7 @@ static void *listener_tcp(void *arg)
  * @param host the host to bind to
  * @param port the port number to bind to
  */
-static int create_udp_server_socket(const char *host, int port)
+static int create_udp_server_socket(const char *host, int port, int reuseport)
 {
 	int nfd;
 
@@ -537,6 +668,12 @@ static int create_udp_server_socket(const char *host, int port)
 
 	int flags = 1;
 	setsockopt(nfd, SOL_SOCKET, SO_REUSEADDR, (char *)&flags, sizeof(int));
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		setsockopt(nfd, SOL_SOCKET, SO_REUSEPORT, (char *)&flags, sizeof(int));
+	}
+#endif
+	set_busy_poll(nfd);
 
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -555,6 +692,57 @@ static int create_udp_server_socket(const char *host, int port)
 	return nfd;
 }
 
+/**
+ * SO_BUSY_POLL of busypoll mode, reads poll the device queue instead
+ * of waiting for the interrupt
+ */
+static void set_busy_poll(int fd)
+{
+#ifdef SO_BUSY_POLL
+	if (g_settings->busy_poll_us > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+				(char *)&g_settings->busy_poll_us, sizeof(int));
+	}
+#endif
+}
+
+/**
+ * Create a SO_REUSEPORT tcp socket bound to host:port, not listening yet
+ */
+static int create_tcp_server_socket(const char *host, int port)
+{
+	int nfd;
+
+	nfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (nfd < 0) return -1;
+
+	int flags = 1;
+	setsockopt(nfd, SOL_SOCKET, SO_REUSEADDR, (char *)&flags, sizeof(int));
+#ifdef SO_REUSEPORT
+	setsockopt(nfd, SOL_SOCKET, SO_REUSEPORT, (char *)&flags, sizeof(int));
+#endif
+	set_busy_poll(nfd);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(host);
+	addr.sin_port        = htons(port);
+
+	if (bind(nfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		close(nfd);
+		return -1;
+	}
+
+	if ((flags = fcntl(nfd, F_GETFL, 0)) < 0 ||
+			fcntl(nfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		close(nfd);
+		return -1;
+	}
+
+	return nfd;
+}
+
 
 
 /**
@@ -580,7 +768,8 @@ static void libevent_cb_udp_recv(int fd, short which, void *arg)
 	int dtlen = 0;
 	size_t data_real_len = 0;
 	size_t salt_len = 0;
-	const char *p = NULL;
+	uint64_t op = 0, trk_id = 0;
+	int is_op_ok = 0;
 	int is_trk_id_ok = 0;
 	/* check data len */
 	static const char *delimiter = "&";
@@ -591,15 +780,11 @@ static void libevent_cb_udp_recv(int fd, short which, void *arg)
 		if (memcmp(pch, "dtlen=", 6) == 0) {
 			dtlen = atoi(pch + 6);
 		} else if (memcmp(pch, "op=", 3) == 0) {
-			trk_item.op = atoi(pch + 3);
+			is_op_ok = parse_uint64(pch + 3, &op) == TRACKD_OK;
 		} else if (memcmp(pch, "data=", 5) == 0) {
 			data_real_len = strlen(pch+5);
 		} else if (memcmp(pch, "trk_id=", 7) == 0) {
-			p = pch + 7;
-			while (isdigit(*p)) { p++; }
-			if (*p == '\0') {
-				is_trk_id_ok = 1;
-			}
+			is_trk_id_ok = parse_uint64(pch + 7, &trk_id) == TRACKD_OK;
 		} else if (memcmp(pch, "salt=", 5) == 0) {
 			salt_len = strlen(pch+5);
 		}
@@ -608,23 +793,59 @@ static void libevent_cb_udp_recv(int fd, short which, void *arg)
 	free(str_cpy);
 
 	// error data, do nothing
-	if (salt_len != SHA1_LEN || !is_trk_id_ok ||
-			dtlen != data_real_len ||
-			(trk_item.op < 0 || trk_item.op >= DDTRACK_OP_MAX)) {
+	struct func *f = is_op_ok ? op_func_get(g_settings, op) : NULL;
+	if (!is_trk_id_ok || f == NULL || dtlen != data_real_len ||
+			!sign_salt_len_ok(f, salt_len)) {
 		return;
 	}
 
+	trk_item.op     = op;
+	trk_item.trk_id = trk_id;
+
 	push_ele_to_pool(&trk_item);
 }
 
 
-static struct trk_thread *pickup_trk_thread()
+static struct trk_thread *pickup_trk_thread(const struct trk_item *trkitem)
 {
 	int old_last_thread;
 	int tid;
+
+	/* the same tracker always meets the same worker, no shared counter */
+	if (g_settings->dispatch == TRK_DISPATCH_AFFINITY) {
+		return trk_thread_route(trkitem->op, trkitem->trk_id);
+	}
+
+	/* power of two choices: the less loaded lane of two random workers */
+	int n = trk_thread_active();
+	if (g_settings->dispatch == TRK_DISPATCH_P2C && n > 1) {
+		static __thread uint32_t seed;
+		struct trk_thread *a, *b;
+		struct trk_lane *la, *lb;
+
+		if (seed == 0) {
+			seed = (uint32_t)(uintptr_t)&seed ^ (uint32_t)time(NULL) ^ 1;
+		}
+		/* xorshift32 */
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		/* two distinct workers */
+		tid = seed % n;
+		a = trk_thread_choose_one(tid);
+		b = trk_thread_choose_one((tid + 1 + (seed >> 16) % (n - 1)) % n);
+		la = trk_thread_lane(a, trkitem->op);
+		lb = trk_thread_lane(b, trkitem->op);
+		if (la == NULL || lb == NULL) {
+			return a;
+		}
+		return pool_size(lb->pool) < pool_size(la->pool) ? b : a;
+	}
+
 	while (1) {
 		old_last_thread = g_last_thread;
-		tid = (old_last_thread + 1) % g_settings->num_worker_threads;
+		tid = (old_last_thread + 1) % n;
 		// CAS
 		if (__sync_bool_compare_and_swap(&g_last_thread, old_last_thread, tid)) {
 			break;
@@ -659,6 +880,8 @@ static void *reset_counter(void *arg)
 	char buf[32];
 	struct tm tm;
 
+	topology_pin(g_settings->misc_cpus);
+
 	while (1) {
 		memset(buf, 0, sizeof(buf));
 		memset(&tm, 0, sizeof(struct tm));
@@ -749,6 +972,139 @@ static int settings_init(struct settings **settings, struct inifile *ini)
 		return -2;
 	}
 
+	(*settings)->pool_bytes = TRK_POOL_BYTES;
+	inifile_fetch_int(ini, "trackd", "pool_bytes",
+			&(*settings)->pool_bytes);
+	if ((*settings)->pool_bytes < (int)sizeof(struct trk_item)) {
+		fprintf(stderr, "'pool_bytes' must be at least %d\n",
+				(int)sizeof(struct trk_item));
+		exit(1);
+	}
+
+	(*settings)->sign_cache_size = SIGN_CACHE_SIZE;
+	inifile_fetch_int(ini, "trackd", "sign_cache_size",
+			&(*settings)->sign_cache_size);
+	if ((*settings)->sign_cache_size < 0) {
+		(*settings)->sign_cache_size = 0;
+	}
+	sign_cache_init((*settings)->sign_cache_size);
+
+	/* mode */
+	const char *mode = NULL;
+	(*settings)->mode = TRK_MODE_PIPELINE;
+	inifile_fetch_str(ini, "trackd", "mode", &mode);
+	if (mode != NULL && strcmp(mode, "per_core") == 0) {
+		(*settings)->mode = TRK_MODE_PER_CORE;
+	} else if (mode != NULL && strcmp(mode, "pipeline") != 0) {
+		fprintf(stderr, "'mode' must be pipeline or per_core\n");
+		exit(1);
+	}
+
+	/* dispatch */
+	const char *dispatch = NULL;
+	(*settings)->dispatch           = TRK_DISPATCH_RR;
+	(*settings)->rebalance_interval = TRK_REBALANCE_INTERVAL;
+	inifile_fetch_str(ini, "trackd", "dispatch", &dispatch);
+	inifile_fetch_int(ini, "trackd", "rebalance_interval",
+			&(*settings)->rebalance_interval);
+	if (dispatch == NULL || strcmp(dispatch, "rr") == 0) {
+		(*settings)->dispatch = TRK_DISPATCH_RR;
+	} else if (strcmp(dispatch, "affinity") == 0) {
+		(*settings)->dispatch = TRK_DISPATCH_AFFINITY;
+	} else if (strcmp(dispatch, "p2c") == 0) {
+		(*settings)->dispatch = TRK_DISPATCH_P2C;
+	} else {
+		fprintf(stderr, "'dispatch' must be rr, affinity or p2c\n");
+		exit(1);
+	}
+
+	/* off unless asked for, it gives up the order of a tracker's events */
+	(*settings)->work_stealing = 0;
+	inifile_fetch_bool(ini, "trackd", "work_stealing",
+			&(*settings)->work_stealing);
+
+	/* worker mode */
+	const char *worker_mode = NULL;
+	(*settings)->worker_mode       = TRK_WORKER_BLOCK;
+	(*settings)->busypoll_spin_us  = TRK_BUSYPOLL_SPIN_US;
+	(*settings)->busypoll_yield_us = TRK_BUSYPOLL_YIELD_US;
+	(*settings)->busy_poll_us      = 0;
+	inifile_fetch_str(ini, "trackd", "worker_mode", &worker_mode);
+	if (worker_mode == NULL || strcmp(worker_mode, "block") == 0) {
+		(*settings)->worker_mode = TRK_WORKER_BLOCK;
+	} else if (strcmp(worker_mode, "busypoll") == 0) {
+		(*settings)->worker_mode  = TRK_WORKER_BUSYPOLL;
+		(*settings)->busy_poll_us = TRK_BUSY_POLL_US;
+	} else {
+		fprintf(stderr, "'worker_mode' must be block or busypoll\n");
+		exit(1);
+	}
+	inifile_fetch_int(ini, "trackd", "busypoll_spin_us",
+			&(*settings)->busypoll_spin_us);
+	inifile_fetch_int(ini, "trackd", "busypoll_yield_us",
+			&(*settings)->busypoll_yield_us);
+	inifile_fetch_int(ini, "trackd", "busy_poll_us",
+			&(*settings)->busy_poll_us);
+	if ((*settings)->busypoll_spin_us < 0 || (*settings)->busypoll_yield_us < 0 ||
+			(*settings)->busy_poll_us < 0) {
+		fprintf(stderr, "'busypoll_spin_us', 'busypoll_yield_us' and 'busy_poll_us' "
+				"can't be negative\n");
+		exit(1);
+	}
+
+	/* [topology] */
+	(*settings)->worker_cpus = settings_cpu_list(ini, "worker_cpus");
+	(*settings)->udp_cpus    = settings_cpu_list(ini, "udp_cpus");
+	(*settings)->http_cpus   = settings_cpu_list(ini, "http_cpus");
+	(*settings)->misc_cpus   = settings_cpu_list(ini, "misc_cpus");
+	inifile_fetch_bool(ini, "topology", "hugepages", &(*settings)->hugepages);
+
+	/* overflow spill, off unless spill_dir is set */
+	const char *compress = NULL;
+	(*settings)->spill_max_mb     = TRK_SPILL_MAX_MB;
+	(*settings)->spill_segment_mb = TRK_SPILL_SEGMENT_MB;
+	(*settings)->spill_compress   = SPILL_COMPRESS_NONE;
+	inifile_fetch_str(ini, "trackd", "spill_dir", &(*settings)->spill_dir);
+	inifile_fetch_int(ini, "trackd", "spill_max_mb",
+			&(*settings)->spill_max_mb);
+	inifile_fetch_int(ini, "trackd", "spill_segment_mb",
+			&(*settings)->spill_segment_mb);
+	inifile_fetch_str(ini, "trackd", "spill_compress", &compress);
+	if (compress != NULL && strcmp(compress, "lz4") == 0) {
+		(*settings)->spill_compress = SPILL_COMPRESS_LZ4;
+	}
+	if ((*settings)->spill_max_mb < 1 || (*settings)->spill_segment_mb < 1) {
+		fprintf(stderr, "'spill_max_mb' and 'spill_segment_mb' must be positive\n");
+		exit(1);
+	}
+
+	/* write-ahead log, off unless wal_dir is set */
+	(*settings)->wal_sync_ms    = TRK_WAL_SYNC_MS;
+	(*settings)->wal_segment_mb = TRK_WAL_SEGMENT_MB;
+	inifile_fetch_str(ini, "trackd", "wal_dir", &(*settings)->wal_dir);
+	inifile_fetch_int(ini, "trackd", "wal_sync_ms",
+			&(*settings)->wal_sync_ms);
+	inifile_fetch_int(ini, "trackd", "wal_segment_mb",
+			&(*settings)->wal_segment_mb);
+	if ((*settings)->wal_sync_ms < 1 || (*settings)->wal_segment_mb < 1) {
+		fprintf(stderr, "'wal_sync_ms' and 'wal_segment_mb' must be positive\n");
+		exit(1);
+	}
+	if (((uint64_t)(*settings)->wal_segment_mb << 20) > WAL_SEGMENT_MAX) {
+		fprintf(stderr, "'wal_segment_mb' is %llu at most, offsets are 32 bits of an lsn\n",
+				(unsigned long long)(WAL_SEGMENT_MAX >> 20));
+		exit(1);
+	}
+
+	/* per_core has no pools to overflow, steal from or replay into */
+	if ((*settings)->mode == TRK_MODE_PER_CORE &&
+			((*settings)->spill_dir || (*settings)->wal_dir ||
+			 (*settings)->work_stealing || (*settings)->dispatch != TRK_DISPATCH_RR)) {
+		fprintf(stderr, "per_core mode takes no 'spill_dir', 'wal_dir', "
+				"'work_stealing' or 'dispatch' other than rr\n");
+		exit(1);
+	}
+
 	inifile_fetch_str(ini, "trackd", "pidfile",&(*settings)->pidfile);
 	inifile_fetch_str(ini, "trackd", "logfile",&(*settings)->logfile);
 
@@ -767,27 +1123,58 @@ static int settings_init(struct settings **settings, struct inifile *ini)
 	}
 
 	/* [op_func_list] */
-	const char *k_op,*k_trk_id,*v_func,*v_token;
+	const char *k_op,*v_func;
 	struct iniitem *iniitem = NULL;
-	struct iniitem *iniitem_token = NULL;
-	struct token_item *token_item = NULL;
+	uint64_t op;
 
+	/* size the op table by the max op */
 	while ((iniitem = inifile_foreach_group(ini, "op_func_list", iniitem,
 					&k_op, &v_func))) {
-		int op = atoi(k_op);
-		if (op < 0 || op >= DDTRACK_OP_MAX) {
-			continue;
+		if (parse_uint64(k_op, &op) != TRACKD_OK || op >= DDTRACK_OP_LIMIT) {
+			fprintf(stderr, "[op_func_list] bad op '%s', op range: [0, %d)\n",
+					k_op, DDTRACK_OP_LIMIT);
+			exit(1);
+		}
+		if (op >= (*settings)->num_op_funcs) {
+			(*settings)->num_op_funcs = op + 1;
+		}
+	}
+
+	if ((*settings)->num_op_funcs == 0) {
+		fprintf(stderr, "[op_func_list] is empty, op range: [0, %d)\n",
+				DDTRACK_OP_LIMIT);
+		exit(1);
+	}
+
+	(*settings)->op_funcs = calloc((*settings)->num_op_funcs, sizeof(struct func *));
+	if (!(*settings)->op_funcs) {
+		return TRACKD_ERR;
+	}
+
+	iniitem = NULL;
+	while ((iniitem = inifile_foreach_group(ini, "op_func_list", iniitem,
+					&k_op, &v_func))) {
+		parse_uint64(k_op, &op);
+
+		/* 1 and 01 are the same op, it would take two lanes */
+		if ((*settings)->op_funcs[op]) {
+			fprintf(stderr, "[op_func_list] op %llu is listed twice, as '%s' too\n",
+					(unsigned long long)op, k_op);
+			exit(1);
 		}
 
 		//init func
 		(*settings)->op_funcs[op] = calloc(1,sizeof(struct func));
+		if (!(*settings)->op_funcs[op]) {
+			return TRACKD_ERR;
+		}
 
 		struct func *f = (*settings)->op_funcs[op];
 		f->op = op;
 		f->func = v_func;
 
 		char groupname[32];
-		snprintf(groupname,sizeof(groupname),"op_func_%d_sinkserver",op);
+		snprintf(groupname,sizeof(groupname),"op_func_%llu_sinkserver",(unsigned long long)op);
 		inifile_fetch_str(ini, groupname, "sink_servers",&(f->sink_servers));
 		inifile_fetch_str(ini, groupname, "sink_type",&(f->sink_type));
 
@@ -795,32 +1182,144 @@ static int settings_init(struct settings **settings, struct inifile *ini)
 		inifile_fetch_str(ini, groupname, "pass",&(f->pass));
 		inifile_fetch_str(ini, groupname, "db",&(f->db));
 
-		//check tokens
-		snprintf(groupname,sizeof(groupname),"op_func_%d_token",op);
+		//per op options
+		snprintf(groupname,sizeof(groupname),"op_func_%llu_option",(unsigned long long)op);
+		inifile_fetch_bool(ini, groupname, "sign_v2",&(f->sign_v2));
+
+		f->lane_weight = 1;
+		f->pool_bytes  = (*settings)->pool_bytes;
+		inifile_fetch_int(ini, groupname, "lane_priority",&(f->lane_priority));
+		inifile_fetch_int(ini, groupname, "lane_weight",&(f->lane_weight));
+		inifile_fetch_int(ini, groupname, "pool_bytes",&(f->pool_bytes));
+		if (f->lane_weight < 1 || f->pool_bytes < (int)sizeof(struct trk_item)) {
+			fprintf(stderr, "[%s] 'lane_weight' must be positive, "
+					"'pool_bytes' at least %d\n", groupname, (int)sizeof(struct trk_item));
+			exit(1);
+		}
+		(*settings)->num_lanes++;
+
+		/* rollup = second,minute,hour,day,month,year */
+		const char *rollup = "second,minute,hour,day,month,year";
+		f->rollup_script = 1;
+		inifile_fetch_str(ini, groupname, "rollup",&rollup);
+		inifile_fetch_bool(ini, groupname, "rollup_script",&(f->rollup_script));
+		if (settings_init_rollup(f, rollup) != TRACKD_OK) {
+			fprintf(stderr, "[%s] bad 'rollup' '%s'\n", groupname, rollup);
+			exit(1);
+		}
 
-		struct token_item *tail = f->tokens;
-		while ((iniitem_token = inifile_foreach_group(ini, groupname, iniitem_token,
-						&k_trk_id, &v_token))) {
-			token_item = calloc(1,sizeof(struct token_item));
+		const char *agg_func = NULL;
+		f->agg_slots = TRK_AGG_SLOTS;
+		inifile_fetch_int(ini, groupname, "agg_window_ms",&(f->agg_window_ms));
+		inifile_fetch_int(ini, groupname, "agg_slots",&(f->agg_slots));
+		inifile_fetch_str(ini, groupname, "agg_func",&agg_func);
+		f->agg_jitter_ms = f->agg_window_ms / 10;
+		inifile_fetch_int(ini, groupname, "agg_jitter_ms",&(f->agg_jitter_ms));
+		f->agg_func = agg_func ? agg_func_parse(agg_func) : AGG_SUM;
+		if (f->agg_window_ms < 0 || f->agg_jitter_ms < 0 || f->agg_slots < 1 ||
+				f->agg_func < 0) {
+			fprintf(stderr, "[%s] bad 'agg_window_ms', 'agg_jitter_ms', 'agg_slots' "
+					"or 'agg_func' (sum, count, min, max, last)\n", groupname);
+			exit(1);
+		}
+		if (f->agg_window_ms > 0 &&
+				(f->sink_type == NULL || memcmp(f->sink_type,"redis",5) != 0)) {
+			fprintf(stderr, "[%s] only redis sinks aggregate\n", groupname);
+			exit(1);
+		}
+		/* the last value folded must be the last one received */
+		if (f->agg_window_ms > 0 && f->agg_func == AGG_LAST &&
+				((*settings)->dispatch != TRK_DISPATCH_AFFINITY ||
+				 (*settings)->work_stealing)) {
+			fprintf(stderr, "[%s] 'agg_func' last needs dispatch = affinity and "
+					"work_stealing = no\n", groupname);
+			exit(1);
+		}
 
-			if (!token_item){
-				return TRACKD_ERR;
-			}
+		/* aggregates are flushed in bulk, they keep the blocking connection */
+		f->redis_async = f->agg_window_ms == 0;
+		f->redis_max_inflight = TRK_REDIS_MAX_INFLIGHT;
+		f->redis_timeout_ms   = TRK_REDIS_TIMEOUT_MS;
+		inifile_fetch_bool(ini, groupname, "redis_async",&(f->redis_async));
+		inifile_fetch_int(ini, groupname, "redis_max_inflight",&(f->redis_max_inflight));
+		inifile_fetch_int(ini, groupname, "redis_timeout_ms",&(f->redis_timeout_ms));
+		if (f->redis_max_inflight < 1 || f->redis_timeout_ms < 1) {
+			fprintf(stderr, "[%s] 'redis_max_inflight' and 'redis_timeout_ms' "
+					"must be positive\n", groupname);
+			exit(1);
+		}
+		if (f->redis_async && f->agg_window_ms > 0) {
+			fprintf(stderr, "[%s] 'redis_async' and 'agg_window_ms' don't mix\n",
+					groupname);
+			exit(1);
+		}
 
-			token_item->trk_id = atoi(k_trk_id);
-			token_item->token  = v_token;
-			token_item->next = NULL;
+		f->mysql_table   = TRK_MYSQL_TABLE;
+		f->mysql_timeout = TRK_MYSQL_TIMEOUT;
+		inifile_fetch_str(ini, groupname, "mysql_table",&(f->mysql_table));
+		inifile_fetch_int(ini, groupname, "mysql_timeout",&(f->mysql_timeout));
+		if (f->mysql_timeout < 1) {
+			fprintf(stderr, "[%s] 'mysql_timeout' must be positive\n", groupname);
+			exit(1);
+		}
+		inifile_fetch_str(ini, groupname, "mysql_columns",&(f->mysql_columns));
+		if (f->mysql_columns && *f->mysql_columns == '\0') {
+			f->mysql_columns = NULL;
+		}
+		if (mysql_sql_names(f->mysql_table) != 1 || strlen(f->mysql_table) > 128 ||
+				(f->mysql_columns && (mysql_sql_names(f->mysql_columns) != 4 ||
+						strlen(f->mysql_columns) > 512))) {
+			fprintf(stderr, "[%s] bad 'mysql_table' or 'mysql_columns' "
+					"(the columns of trk_id,date,data,time)\n", groupname);
+			exit(1);
+		}
 
-			if( tail == NULL ){
-				f->tokens= token_item;
-				tail = f->tokens;
-			}else{
-				tail->next = token_item;
-				tail = tail->next;
-			}
+		f->coalesce_max = TRK_COALESCE_MAX;
+		f->coalesce_by  = TRK_COALESCE_BY;
+		inifile_fetch_int(ini, groupname, "coalesce_ms",&(f->coalesce_ms));
+		inifile_fetch_int(ini, groupname, "coalesce_max",&(f->coalesce_max));
+		inifile_fetch_str(ini, groupname, "coalesce_by",&(f->coalesce_by));
+		if (f->coalesce_ms < 0 || f->coalesce_max < 1 ||
+				strlen(f->coalesce_by) > 14) {
+			fprintf(stderr, "[%s] bad 'coalesce_ms', 'coalesce_max' or 'coalesce_by'\n",
+					groupname);
+			exit(1);
+		}
+		if (f->coalesce_ms > 0 && f->agg_window_ms > 0) {
+			fprintf(stderr, "[%s] 'coalesce_ms' and 'agg_window_ms' don't mix\n",
+					groupname);
+			exit(1);
+		}
+		/* only the latest item of a key is written: the write must not add up */
+		if (f->coalesce_ms > 0 && (f->sink_type == NULL ||
+					(memcmp(f->sink_type,"mysql",5) != 0 &&
+					 (memcmp(f->sink_type,"redis",5) != 0 || op != 2)))) {
+			fprintf(stderr, "[%s] 'coalesce_ms' needs idempotent writes: mysql sinks "
+					"(REPLACE) or dashboard (op 2) on redis (HSET)\n", groupname);
+			exit(1);
+		}
+		/* and a key's items on one worker, in the order received */
+		if (f->coalesce_ms > 0 && ((*settings)->dispatch != TRK_DISPATCH_AFFINITY ||
+					(*settings)->work_stealing)) {
+			fprintf(stderr, "[%s] 'coalesce_ms' needs dispatch = affinity and "
+					"work_stealing = no\n", groupname);
+			exit(1);
+		}
+
+		//check tokens
+		if (settings_init_tokens(f, ini) != TRACKD_OK) {
+			fprintf(stderr, "load tokens of op %llu failure\n", (unsigned long long)op);
+			exit(1);
 		}
 	}
 
+	if (settings_init_lanes(*settings) != TRACKD_OK) {
+		return TRACKD_ERR;
+	}
+
+	/* tokens (re)loaded, drop cached verifications */
+	sign_cache_invalidate();
+
 	/* check settings value */
 	if ((*settings)->num_worker_threads < 1 ||
 			(*settings)->num_worker_threads > 64) {
@@ -828,23 +1327,196 @@ static int settings_init(struct settings **settings, struct inifile *ini)
 		exit(1);
 	}
 
-	/* check op func list */
-	int i = DDTRACK_OP_MAX - 1;
-	for (; i >= 0; --i) {
-		if((*settings)->op_funcs[i] && (*settings)->op_funcs[i]->func != NULL){
-			break;
+	/* autoscaling, off unless min and max differ */
+	(*settings)->min_worker_threads = (*settings)->num_worker_threads;
+	(*settings)->max_worker_threads = (*settings)->num_worker_threads;
+	(*settings)->autoscale_interval = TRK_AUTOSCALE_INTERVAL;
+	inifile_fetch_int(ini, "trackd", "min_worker_threads",
+			&(*settings)->min_worker_threads);
+	inifile_fetch_int(ini, "trackd", "max_worker_threads",
+			&(*settings)->max_worker_threads);
+	inifile_fetch_int(ini, "trackd", "autoscale_interval",
+			&(*settings)->autoscale_interval);
+	if ((*settings)->min_worker_threads < 1 ||
+			(*settings)->min_worker_threads > (*settings)->num_worker_threads ||
+			(*settings)->max_worker_threads < (*settings)->num_worker_threads ||
+			(*settings)->max_worker_threads > 64) {
+		fprintf(stderr, "need 1 <= 'min_worker_threads' <= 'num_worker_threads'"
+				" <= 'max_worker_threads' <= 64\n");
+		exit(1);
+	}
+	if ((*settings)->max_worker_threads > (*settings)->min_worker_threads &&
+			((*settings)->mode != TRK_MODE_PIPELINE ||
+			 (*settings)->dispatch == TRK_DISPATCH_AFFINITY ||
+			 (*settings)->autoscale_interval < 1)) {
+		fprintf(stderr, "autoscaling needs pipeline mode, rr or p2c dispatch"
+				" and a positive 'autoscale_interval'\n");
+		exit(1);
+	}
+
+	return 0;
+}
+
+
+/**
+ * the time buckets of rollup, a comma separated list of second,
+ * minute, hour, day, month and year, as field prefix lengths
+ */
+static int settings_init_rollup(struct func *f, const char *rollup)
+{
+	static const char *names[] = {"second", "minute", "hour", "day", "month", "year"};
+	int seen[6] = {0};
+	const char *p = rollup;
+	int i;
+
+	while (*p) {
+		size_t len = strcspn(p, ",");
+		for (i = 0; i < 6; i++) {
+			if (len == strlen(names[i]) && memcmp(p, names[i], len) == 0) {
+				seen[i] = 1;
+				break;
+			}
+		}
+		if (i == 6) {
+			return TRACKD_ERR;
+		}
+		p += len;
+		if (*p == ',') {
+			p++;
+		}
+	}
+
+	/* longest prefix first, the field is cut down in turn */
+	f->num_rollup = 0;
+	for (i = 0; i < 6; i++) {
+		if (seen[i]) {
+			f->rollup[f->num_rollup++] = 14 - 2 * i;
 		}
 	}
+	return f->num_rollup > 0 ? TRACKD_OK : TRACKD_ERR;
+}
+
+
+/**
+ * a cpu list of [topology], NULL if not set
+ */
+static struct cpu_list *settings_cpu_list(struct inifile *ini, const char *key)
+{
+	const char *v = NULL;
+	struct cpu_list *l;
+
+	inifile_fetch_str(ini, "topology", key, &v);
+	if (v == NULL || *v == '\0') {
+		return NULL;
+	}
 
-	if (i < 0) {
-		fprintf(stderr, "[op_func_list] is empty, op range: [1, %d)\n",
-				DDTRACK_OP_MAX);
+	l = malloc(sizeof(struct cpu_list));
+	if (!l || topology_parse(v, l) != TRACKD_OK) {
+		fprintf(stderr, "[topology] bad cpu list %s = %s\n", key, v);
 		exit(1);
 	}
+	return l;
+}
 
-	return 0;
+static int cmp_lane(const void *a, const void *b)
+{
+	const struct func *x = *(struct func * const *)a;
+	const struct func *y = *(struct func * const *)b;
+
+	if (x->lane_priority != y->lane_priority) {
+		return y->lane_priority - x->lane_priority;
+	}
+	return x->op - y->op;
 }
 
+/**
+ * order the funcs into lanes, highest lane_priority first
+ */
+static int settings_init_lanes(struct settings *settings)
+{
+	int i, n = 0;
+
+	settings->lanes = calloc(settings->num_lanes, sizeof(struct func *));
+	if (!settings->lanes) {
+		return TRACKD_ERR;
+	}
+	for (i = 0; i < settings->num_op_funcs; i++) {
+		if (settings->op_funcs[i]) {
+			settings->lanes[n++] = settings->op_funcs[i];
+		}
+	}
+	qsort(settings->lanes, n, sizeof(struct func *), cmp_lane);
+	for (i = 0; i < n; i++) {
+		settings->lanes[i]->lane = i;
+	}
+	return TRACKD_OK;
+}
+
+/**
+ * load tokens of an op into its token store,
+ * from "token_file" in [op_func_N_option] if set (see tulipa-tokentool),
+ * otherwise from [op_func_N_token]
+ */
+static int settings_init_tokens(struct func *f, struct inifile *ini)
+{
+	char groupname[32];
+	const char *token_file = NULL;
+
+	snprintf(groupname,sizeof(groupname),"op_func_%d_option",f->op);
+	inifile_fetch_str(ini, groupname, "token_file",&token_file);
+
+	if (token_file != NULL) {
+		f->tokens = token_store_open(token_file);
+		if (f->tokens == NULL) {
+			fprintf(stderr, "open token file failure, file: %s\n", token_file);
+			return TRACKD_ERR;
+		}
+		if (f->sign_v2 && !token_store_has_hmac(f->tokens)) {
+			fprintf(stderr, "token file %s has no hmac states, "
+					"rebuild it with tulipa-tokentool -s\n", token_file);
+			return TRACKD_ERR;
+		}
+	} else {
+		const char *k_trk_id,*v_token;
+		struct iniitem *iniitem = NULL;
+		size_t n = 0, cap = 16;
+		struct token_entry *entries = malloc(cap * sizeof(struct token_entry));
+		if (!entries) {
+			return TRACKD_ERR;
+		}
+
+		snprintf(groupname,sizeof(groupname),"op_func_%d_token",f->op);
+		while ((iniitem = inifile_foreach_group(ini, groupname, iniitem,
+						&k_trk_id, &v_token))) {
+			if (n == cap) {
+				struct token_entry *p = realloc(entries,
+						(cap *= 2) * sizeof(struct token_entry));
+				if (!p) {
+					free(entries);
+					return TRACKD_ERR;
+				}
+				entries = p;
+			}
+			if (parse_uint64(k_trk_id, &entries[n].trk_id) != TRACKD_OK) {
+				fprintf(stderr, "[%s] bad trk_id '%s', skipped\n",
+						groupname, k_trk_id);
+				continue;
+			}
+			entries[n].token  = v_token;
+			n++;
+		}
+
+		f->tokens = token_store_new(entries, n, f->sign_v2);
+		free(entries);
+		if (f->tokens == NULL) {
+			return TRACKD_ERR;
+		}
+	}
+
+	trackdLog(TRACKD_DEBUG,"op %d loaded %zu tokens",
+			f->op, token_store_count(f->tokens));
+	return TRACKD_OK;
+}
 
 static void print_help()
 {
@@ -891,21 +1563,50 @@ static void parse_arguments(int argc, char *argv[])
 
 static inline void push_ele_to_pool(struct trk_item *trkitem)
 {
+	/* per_core: this worker received it, this worker sinks it */
+	if (g_settings->mode == TRK_MODE_PER_CORE && trk_thread_self) {
+		trk_thread_sink(trk_thread_self, trkitem);
+		return;
+	}
+
+	/* a worker retiring under us turns us away, see trk_thread_enter() */
 	struct trk_thread *t;
-	int res;
-	while (1) {
-		t = pickup_trk_thread();
-		res = pool_push(t->pool, trkitem);
-		if (res == 0/*success*/ || res == -2/*system overload ignore*/) {
-			break;
+	while (trk_thread_enter(t = pickup_trk_thread(trkitem)) != TRACKD_OK) {
+		if (trk_thread_stopping()) {
+			__sync_fetch_and_add(&g_running->discarded, 1);
+			return;
 		}
-		usleep(1);
 	}
 
-	/* write notify to pipe */
-	if (res == 0 && write(t->notify_send_fd, "", 1) != 1) {
-		fprintf(stderr, "write thread notify pipe failure\n");
+	struct trk_lane *lane = trk_thread_lane(t, trkitem->op);
+	size_t len = trk_item_len(trkitem);
+
+	trkitem->enq_us = trk_clock_us();
+
+	/* logged before it is queued, acked by the worker once sunk */
+	if (t->wal) {
+		trkitem->lsn = wal_append(t->wal, trkitem, len);
 	}
+
+	/* lock free, only fails when the pool is full: system overload */
+	if (lane && pool_push(lane->pool, trkitem, len) == 0) {
+		trk_thread_notify(t);
+		trk_thread_leave(t);
+		return;
+	}
+
+	/* overflow to disk, replayed once the pool drained */
+	if (t->spill && spill_append(t->spill, trkitem, len) == TRACKD_OK) {
+		__sync_fetch_and_add(&g_running->spilled, 1);
+		trk_thread_notify(t);
+		trk_thread_leave(t);
+		return;
+	}
+	__sync_fetch_and_add(&g_running->discarded, 1);
+	if (t->wal) {
+		wal_ack(t->wal, &trkitem->lsn, 1);
+	}
+	trk_thread_leave(t);
 }
 
 static void settings_free(struct settings *settings){
@@ -913,22 +1614,22 @@ static void settings_free(struct settings *settings){
 
 	int i;
 	struct func *f;
-	struct token_item *p,*q;
-	for(i=0;i<DDTRACK_OP_MAX;i++){
+	for(i=0;i<settings->num_op_funcs;i++){
 		f = settings->op_funcs[i];
 		if(f == NULL){
 			continue;
 		}
 
-		p = f->tokens;
-		while(p){
-			q = p->next;
-			free(p);
-			p = q;
-		}
+		token_store_free(f->tokens);
 
 		free(f);
 	}
+	free(settings->op_funcs);
+	free(settings->lanes);
+	free(settings->worker_cpus);
+	free(settings->udp_cpus);
+	free(settings->http_cpus);
+	free(settings->misc_cpus);
 	free(settings);
 }
 
@@ -952,59 +1653,19 @@ static void sigtermHandler(int sig) {
 	}
 }
 
-static void sigtermHandlerChild(int sig) {
-	trackdLogFromHandler(TRACKD_WARNING,"Worker Process Received SIGTERM, scheduling shutdown...");
-
-	struct trk_thread *thread;
-	int i,j,k;
-	//check pool
-	while(1){
-		size_t total_size     = 0;
-
-		for (i = 0; i < g_settings->num_worker_threads; ++i) {
-			thread = trk_thread_choose_one(i);
-			size_t size = pool_size(thread->pool);
-			total_size     += size;
-		}
-
-		if(total_size == 0) {
-			trackdLogFromHandler(TRACKD_WARNING,"empty pool, really going down...");
-			break;
-		}
-		trackdLogFromHandler(TRACKD_WARNING,
-				"trying shutdown but there are still items in pool");
-		sleep(1);
-	}
-
-	//iter every worker thread,
-	//close sink server connection;free pool
-	struct trk_sink_client *client;
-	struct trk_client_node *node;
-	for (i = 0; i < g_settings->num_worker_threads; ++i) {
-		thread = trk_thread_choose_one(i);
-
-		pool_free(thread->pool);
-		event_base_free(thread->base);
-
-		for(j=0;j < DDTRACK_OP_MAX;j++){
-			client = thread->trk_r_clients[j];
-
-			if(client == NULL){
-				continue;
-			}
-
-			for(k=0;k < client->num_clients;k++){
-				node = client->nodes + k;
-				node->finalizer(node->conn);
-			}
-		}
-	}
+/*
+ * SIGTERM of the worker process, on its main thread: every worker
+ * drains, flushes and hangs up on its own thread, and is joined before
+ * anything of it is freed. The listeners run until we exit, what they
+ * get from now on is dropped
+ */
+static void worker_shutdown() {
+	trackdLog(TRACKD_WARNING,"Worker Process Received SIGTERM, scheduling shutdown...");
 
-	inifile_free(g_ini);
-	free(g_running);
-	settings_free(g_settings);
+	trk_thread_shutdown();
+	trackdLog(TRACKD_WARNING,"empty pool, really going down...");
 
-	//clean mysql library
-	//mysql_library_end();
-	trackdLogFromHandler(TRACKD_WARNING,"child byebye.");
+	mysql_library_end();
+	trackdLog(TRACKD_WARNING,"child byebye.");
+	exit(0);
 }
@@ -32,9 +32,13 @@
 #define __TRACKD_H__
 
 #include<time.h>
+#include<stdint.h>
+#include<stddef.h>
+#include<string.h>
 
-#define DDTRACK_OP_MAX    32 /* max op */
+#define DDTRACK_OP_LIMIT 65536 /* op must in [0, DDTRACK_OP_LIMIT) */
 #define TRK_MAX_MSG_LEN 1472 /* 1500(MTU) - 20(IP) - 8(UDP) */
+#define TRK_QUERY_STR_LEN (TRK_MAX_MSG_LEN - 12)
 #define EVHTP_THREAD_NUM  4 /* number of evhtp threads, set 0 will NOT use multi thread */
 #define DDTRACK_SERVER_NAME "Tulipa 1.0"
 
@@ -48,11 +52,19 @@
 
 /* trk item in pool */
 struct trk_item {
-	int op:5;
-	int trk_id:27;
-	char query_str[TRK_MAX_MSG_LEN];
+	uint64_t trk_id;
+	uint64_t lsn;       /* in the worker's wal, 0 if not logged */
+	uint64_t enq_us;    /* monotonic time it was queued, for lane stats */
+	uint32_t op;
+	char query_str[TRK_QUERY_STR_LEN];
 };
 
+/* bytes of a trk item up to the end of query_str, what a pool record holds */
+static inline size_t trk_item_len(const struct trk_item *item)
+{
+	return offsetof(struct trk_item, query_str) + strlen(item->query_str) + 1;
+}
+
 
 /* track server http return code */
 typedef enum {
@@ -73,6 +85,29 @@ struct running {
 	time_t start_time;
 	unsigned long long today_req_num;
 	unsigned long long total_req_num;
+
+	/* overflow spill, see spill.h */
+	unsigned long long spilled;
+	unsigned long long replayed;
+	unsigned long long discarded; /* no room in pool or spill, or a sink refused it */
+
+	unsigned long long route_moves; /* buckets rebalanced, see route.h */
+
+	/* work stealing */
+	unsigned long long steals;  /* ticks that stole anything */
+	unsigned long long stolen;  /* items */
+
+	/* aggregation */
+	unsigned long long agg_events; /* folded into aggregates */
+	unsigned long long agg_writes; /* aggregates written out */
+
+	/* coalescing */
+	unsigned long long coalesce_events;
+	unsigned long long coalesce_writes;
+
+	/* autoscaling */
+	unsigned long long scale_ups;
+	unsigned long long scale_downs;
 };
 
 struct settings {
@@ -90,12 +125,56 @@ struct settings {
 	int worker_pid_alive;
 	int shutdown_asap; 
 
-	int num_worker_threads;
-
-	/* funcs */
-	struct func *op_funcs[DDTRACK_OP_MAX];
+	int num_worker_threads; /* at start */
+	int min_worker_threads; /* autoscaling bounds, both num_worker_threads */
+	int max_worker_threads; /* unless set */
+	int autoscale_interval; /* sec */
+	int mode;               /* TRK_MODE_* */
+	int dispatch;           /* TRK_DISPATCH_* */
+	int rebalance_interval; /* sec, 0 to disable */
+	int work_stealing;      /* idle workers take items of busy ones */
+	int worker_mode;        /* TRK_WORKER_* */
+	int busypoll_spin_us;   /* idle time spinning, then yielding */
+	int busypoll_yield_us;  /* idle time yielding, then blocking */
+	int busy_poll_us;       /* SO_BUSY_POLL of sockets, 0 to disable */
+
+	/* [topology], NULL for threads that are not pinned */
+	struct cpu_list *worker_cpus; /* a cpu per worker, in turn */
+	struct cpu_list *udp_cpus;
+	struct cpu_list *http_cpus;   /* http listener and evhtp threads */
+	struct cpu_list *misc_cpus;   /* reset counter, wal sync, rebalance */
+	int hugepages;                /* pools on huge pages */
+	int pool_bytes;      /* default bytes of each lane's pool, not split over lanes */
+
+	int sign_cache_size; /* entries per thread, 0 to disable */
+
+	const char *spill_dir; /* NULL to drop events when a pool is full */
+	int spill_max_mb;      /* disk budget, shared by all workers */
+	int spill_segment_mb;
+	int spill_compress;    /* SPILL_COMPRESS_* */
+
+	const char *wal_dir;   /* NULL to run without the write-ahead log */
+	int wal_sync_ms;       /* group commit interval */
+	int wal_segment_mb;
+
+	/* funcs, indexed by op, NULL for the holes */
+	struct func **op_funcs;
+	int num_op_funcs; /* max op + 1 */
+
+	/* the configured funcs by lane_priority, highest first, see thread.h */
+	struct func **lanes;
+	int num_lanes;
 };
 
+/* dense op dispatch, NULL if op is not configured */
+static inline struct func *op_func_get(const struct settings *settings, long long op)
+{
+	if (op < 0 || op >= settings->num_op_funcs) {
+		return NULL;
+	}
+	return settings->op_funcs[op];
+}
+
 /*
  * A func is a complete track work flow,
  * which has a single-linked sink_servers list
@@ -113,22 +192,48 @@ struct func{
 	//args
 	//const char *args;
 
-	//single linked list
-	struct token_item *tokens;
+	//open-addressing table, see tokenstore.h
+	struct token_store *tokens;
+
+	//accept v2 (hmac-sha256) salts, see sign.h
+	int sign_v2;
+
+	//ddtrack time buckets, lengths of the second field's prefixes
+	int rollup[6];     /* longest first */
+	int num_rollup;
+	int rollup_script; /* by a server side script on redis */
+
+	//aggregation in every worker, see agg.h
+	int agg_window_ms; /* flush interval, 0 to sink every event */
+	int agg_jitter_ms; /* flush later by up to this, default window / 10 */
+	int agg_func;      /* AGG_*, default sum */
+	int agg_slots;     /* (key, field) pairs per worker */
+
+	//redis writes on the worker's event loop, see redisjob.h
+	int redis_async;        /* default on, off with aggregation */
+	int redis_max_inflight; /* commands out per node before draining stops */
+	int redis_timeout_ms;   /* a node with replies due that long is dropped */
+
+	//rows of a mysql sink, see mysqljob.h
+	const char *mysql_table;   /* default T_Zhixin_Stat */
+	const char *mysql_columns; /* of trk_id,date,data,time, NULL for all by position */
+	int mysql_timeout;         /* sec, of connects, reads and writes */
+
+	//last-write-wins buffer in every worker, see coalesce.h
+	int coalesce_ms;   /* flush interval, 0 to write every event */
+	int coalesce_max;  /* keys per worker, flushed early when reached */
+	const char *coalesce_by; /* query arg that keys with trk_id */
+
+	//own lane in every worker, see thread.h
+	int lane;          /* index in settings->lanes */
+	int lane_priority; /* higher is served first, default 0 */
+	int lane_weight;   /* share among lanes of the same priority, default 1 */
+	int pool_bytes;    /* of the lane, default pool_bytes in [trackd] */
 
 	const char *func;
 	int op;
 };
 
-/* 
- * every trk_id has a single-linked token-items list
- */
-struct token_item{
-	int trk_id;
-	const char *token;
-	struct token_item *next;
-};
-
 struct func_arg{
 	int op;
 	struct arg_item *args[10];
@@ -44,7 +44,24 @@ extern struct settings *g_settings;
 
 int cmp( const void *a , const void *b ) 
 { 
-	return (*(struct dict*)a).v - (*(struct dict*)b).v; 
+	long long x = (*(struct dict*)a).v;
+	long long y = (*(struct dict*)b).v;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+int parse_uint64(const char *str, uint64_t *val)
+{
+	uint64_t v = 0;
+	const char *p = str;
+
+	if (*p == '\0') return TRACKD_ERR;
+	for (; *p; p++) {
+		if (*p < '0' || *p > '9') return TRACKD_ERR;
+		if (v > (UINT64_MAX - (*p - '0')) / 10) return TRACKD_ERR;
+		v = v * 10 + (*p - '0');
+	}
+	*val = v;
+	return TRACKD_OK;
 }
 
 int silence()
@@ -37,6 +37,8 @@
 #endif
 #endif
 
+#include <stdint.h>
+
 int daemonize(int chdir2root);
 int silence();
 
@@ -44,10 +46,13 @@ const char * kv_find(const char * query_str,const char * key);
 
 struct dict{
 	const char *p;
-	int v;
+	long long v;
 };
 
 int cmp( const void *a , const void *b );
+
+/* strict decimal, no sign, no overflow. If successful, return zero */
+int parse_uint64(const char *str, uint64_t *val);
 void setupSignalHandlers(void sigtermHandler(int));
 void createPidFile(const char *pidfile);
 
@@ -0,0 +1,466 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "wal.h"
+#include "trackd.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct wal_rec {
+	uint32_t len;
+	uint32_t sum;
+};
+
+#define WAL_REC_HDR   sizeof(struct wal_rec)
+#define WAL_ALIGN(n)  (((n) + 7) & ~(size_t)7)
+
+/* what the sync thread flushes, taken under the lock */
+struct wal_dirty {
+	uint64_t seq;
+	char    *base;
+	size_t   from;
+	size_t   to;
+};
+
+
+static uint32_t wal_sum(const void *p, size_t len)
+{
+	const unsigned char *s = p;
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static void wal_path(struct wal *w, uint64_t seq, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/wal-%d-%016llx.log",
+			w->dir, w->worker, (unsigned long long)seq);
+}
+
+
+static void wal_segment_unmap(struct wal_segment *seg)
+{
+	munmap(seg->base, seg->size);
+	close(seg->fd);
+	seg->base = NULL;
+}
+
+
+/* create the next segment, w->lock held */
+static struct wal_segment *wal_segment_create(struct wal *w)
+{
+	char path[512];
+	struct wal_segment *seg;
+
+	if (w->nsegs == w->cap) {
+		int cap = w->cap ? w->cap * 2 : 8;
+		struct wal_segment *p = realloc(w->segs, cap * sizeof(struct wal_segment));
+		if (!p) {
+			return NULL;
+		}
+		w->segs = p;
+		w->cap  = cap;
+	}
+	seg = &w->segs[w->nsegs];
+	memset(seg, 0, sizeof(struct wal_segment));
+
+	wal_path(w, w->next_seq, path, sizeof(path));
+	seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (seg->fd == -1) {
+		fprintf(stderr, "create wal segment %s failure: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(seg->fd, w->segment_bytes) != 0 ||
+			(seg->base = mmap(NULL, w->segment_bytes, PROT_READ | PROT_WRITE,
+					MAP_SHARED, seg->fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "map wal segment %s failure: %s\n", path, strerror(errno));
+		close(seg->fd);
+		unlink(path);
+		return NULL;
+	}
+
+	seg->seq  = w->next_seq++;
+	seg->size = w->segment_bytes;
+	w->nsegs++;
+	return seg;
+}
+
+
+static struct wal_segment *wal_segment_find(struct wal *w, uint64_t seq)
+{
+	int i;
+	for (i = 0; i < w->nsegs; i++) {
+		if (w->segs[i].seq == seq) {
+			return &w->segs[i];
+		}
+	}
+	return NULL;
+}
+
+
+static int cmp_seq(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* collect the segments of a previous run */
+static int wal_recover(struct wal *w)
+{
+	DIR *d;
+	struct dirent *de;
+	int cap = 0;
+
+	d = opendir(w->dir);
+	if (d == NULL) {
+		fprintf(stderr, "open wal_dir %s failure: %s\n", w->dir, strerror(errno));
+		return TRACKD_ERR;
+	}
+	while ((de = readdir(d)) != NULL) {
+		int worker;
+		unsigned long long seq;
+		char end;
+
+		if (sscanf(de->d_name, "wal-%d-%llx.lo%c", &worker, &seq, &end) != 3 ||
+				end != 'g' || worker != w->worker) {
+			continue;
+		}
+		if (w->nreplay == cap) {
+			uint64_t *p = realloc(w->replay_seqs, (cap = cap ? cap * 2 : 16) * sizeof(uint64_t));
+			if (!p) {
+				closedir(d);
+				return TRACKD_ERR;
+			}
+			w->replay_seqs = p;
+		}
+		w->replay_seqs[w->nreplay++] = seq;
+		if (seq >= w->next_seq) {
+			w->next_seq = seq + 1;
+		}
+	}
+	closedir(d);
+
+	qsort(w->replay_seqs, w->nreplay, sizeof(uint64_t), cmp_seq);
+	return TRACKD_OK;
+}
+
+
+struct wal *wal_open(const char *dir, int worker, size_t segment_bytes)
+{
+	struct wal *w;
+
+	if ((uint64_t)segment_bytes > WAL_SEGMENT_MAX) {
+		return NULL;
+	}
+	w = calloc(1, sizeof(struct wal));
+	if (!w) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_mutex_init(&w->sync_lock, NULL);
+	w->dir           = strdup(dir);
+	w->worker        = worker;
+	w->segment_bytes = WAL_ALIGN(segment_bytes);
+	w->next_seq      = 1;  /* LSN 0 is never used */
+
+	if (!w->dir || wal_recover(w) != TRACKD_OK) {
+		free(w->replay_seqs);
+		free(w->dir);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+
+/**
+ * the struct itself is kept: the sync thread may still look at it,
+ * and does nothing once it is closed
+ */
+void wal_close(struct wal *w)
+{
+	int i;
+
+	assert(w);
+	wal_sync(w);
+
+	pthread_mutex_lock(&w->sync_lock);
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < w->nsegs; i++) {
+		struct wal_segment *seg = &w->segs[i];
+		wal_segment_unmap(seg);
+		if (seg->outstanding == 0) {
+			char path[512];
+			wal_path(w, seg->seq, path, sizeof(path));
+			unlink(path);
+		}
+	}
+	if (w->replay.base) {
+		wal_segment_unmap(&w->replay);
+	}
+	free(w->segs);
+	free(w->replay_seqs);
+	w->segs = NULL;
+	w->replay_seqs = NULL;
+	w->nsegs = w->nreplay = w->replay_idx = 0;
+	w->closed = 1;
+	pthread_mutex_unlock(&w->lock);
+	pthread_mutex_unlock(&w->sync_lock);
+}
+
+
+uint64_t wal_append(struct wal *w, const void *rec, size_t len)
+{
+	struct wal_rec hdr;
+	struct wal_segment *seg = NULL;
+	size_t need = WAL_REC_HDR + WAL_ALIGN(len);
+	uint64_t lsn;
+
+	if (len == 0 || need > w->segment_bytes) {
+		return 0;
+	}
+	hdr.len = len;
+	hdr.sum = wal_sum(rec, len);
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->closed) {
+		pthread_mutex_unlock(&w->lock);
+		return 0;
+	}
+	if (w->nsegs > 0 && !w->segs[w->nsegs - 1].sealed) {
+		seg = &w->segs[w->nsegs - 1];
+		if (seg->off + need > seg->size) {
+			seg->sealed = 1;
+			seg = NULL;
+		}
+	}
+	if (!seg && !(seg = wal_segment_create(w))) {
+		pthread_mutex_unlock(&w->lock);
+		return 0;
+	}
+
+	/* payload first, a zero header ends the segment if we crash here */
+	memcpy(seg->base + seg->off + WAL_REC_HDR, rec, len);
+	memcpy(seg->base + seg->off, &hdr, WAL_REC_HDR);
+	lsn = seg->seq << 32 | seg->off;
+	seg->off += need;
+	seg->outstanding++;
+
+	pthread_mutex_unlock(&w->lock);
+	return lsn;
+}
+
+
+void wal_ack(struct wal *w, const uint64_t *lsns, size_t n)
+{
+	struct wal_segment *seg = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < n; i++) {
+		if (lsns[i] == 0) {
+			continue;
+		}
+		/* a batch is mostly from one segment */
+		if (!seg || seg->seq != WAL_LSN_SEQ(lsns[i])) {
+			seg = wal_segment_find(w, WAL_LSN_SEQ(lsns[i]));
+		}
+		if (seg && seg->outstanding > 0) {
+			seg->outstanding--;
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+void wal_sync(struct wal *w)
+{
+	struct wal_dirty *dirty;
+	int i, j, n = 0;
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	pthread_mutex_lock(&w->sync_lock);
+	pthread_mutex_lock(&w->lock);
+
+	if (w->closed || w->nsegs == 0) {
+		pthread_mutex_unlock(&w->lock);
+		pthread_mutex_unlock(&w->sync_lock);
+		return;
+	}
+	dirty = malloc(w->nsegs * sizeof(struct wal_dirty));
+	for (i = 0; dirty && i < w->nsegs; i++) {
+		if (w->segs[i].synced < w->segs[i].off) {
+			dirty[n].seq  = w->segs[i].seq;
+			dirty[n].base = w->segs[i].base;
+			dirty[n].from = w->segs[i].synced;
+			dirty[n].to   = w->segs[i].off;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	/* only this thread unmaps segments, appends go on meanwhile */
+	for (i = 0; i < n; i++) {
+		size_t from = dirty[i].from & ~(page - 1);
+		if (msync(dirty[i].base + from, dirty[i].to - from, MS_SYNC) != 0) {
+			fprintf(stderr, "msync wal segment failure: %s\n", strerror(errno));
+			dirty[i].to = dirty[i].from;
+		}
+	}
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < n; i++) {
+		struct wal_segment *seg = wal_segment_find(w, dirty[i].seq);
+		if (seg && dirty[i].to > seg->synced) {
+			seg->synced = dirty[i].to;
+		}
+	}
+
+	/*
+	 * drop sealed segments whose records were all acked; a fully acked
+	 * segment being written is sealed too, or a restart would replay it
+	 */
+	for (i = 0, j = 0; i < w->nsegs; i++) {
+		struct wal_segment *seg = &w->segs[i];
+		if (seg->off > 0 && seg->outstanding == 0 && seg->synced == seg->off) {
+			seg->sealed = 1;
+		}
+		if (seg->sealed && seg->outstanding == 0 && seg->synced == seg->off) {
+			char path[512];
+			wal_path(w, seg->seq, path, sizeof(path));
+			wal_segment_unmap(seg);
+			unlink(path);
+			continue;
+		}
+		w->segs[j++] = *seg;
+	}
+	w->nsegs = j;
+
+	pthread_mutex_unlock(&w->lock);
+	pthread_mutex_unlock(&w->sync_lock);
+	free(dirty);
+}
+
+
+/* map the next segment of the previous run, 0 if there is none */
+static int wal_replay_next(struct wal *w)
+{
+	char path[512];
+	struct stat st;
+
+	while (w->replay_idx < w->nreplay) {
+		struct wal_segment *seg = &w->replay;
+
+		wal_path(w, w->replay_seqs[w->replay_idx], path, sizeof(path));
+		seg->fd = open(path, O_RDONLY);
+		if (seg->fd == -1) {
+			w->replay_idx++;
+			continue;
+		}
+		if (fstat(seg->fd, &st) != 0 || st.st_size == 0 ||
+				(seg->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					seg->fd, 0)) == MAP_FAILED) {
+			seg->base = NULL;
+			close(seg->fd);
+			unlink(path);
+			w->replay_idx++;
+			continue;
+		}
+		madvise(seg->base, st.st_size, MADV_SEQUENTIAL);
+		seg->seq  = w->replay_seqs[w->replay_idx];
+		seg->size = st.st_size;
+		seg->off  = 0;
+		return 1;
+	}
+	return 0;
+}
+
+
+size_t wal_replay(struct wal *w, void *recs, size_t stride, size_t max)
+{
+	struct wal_segment *seg = &w->replay;
+	char *dst = recs;
+	size_t n = 0;
+	char path[512];
+
+	/* the caller sank what the last call returned */
+	if (w->replay_done) {
+		wal_path(w, w->replay_done_seq, path, sizeof(path));
+		unlink(path);
+		w->replay_done = 0;
+	}
+
+	while (n < max) {
+		if (!seg->base && !wal_replay_next(w)) {
+			break;
+		}
+
+		const struct wal_rec *hdr = (const struct wal_rec *)(seg->base + seg->off);
+		const char *payload = seg->base + seg->off + WAL_REC_HDR;
+
+		/* end of the segment, or a record torn by the crash */
+		if (seg->off + WAL_REC_HDR > seg->size || hdr->len == 0 ||
+				hdr->len > seg->size - seg->off - WAL_REC_HDR ||
+				hdr->sum != wal_sum(payload, hdr->len)) {
+			wal_segment_unmap(seg);
+			w->replay_idx++;
+			/* records of it go out with this call, remove it with the next */
+			if (n > 0) {
+				w->replay_done     = 1;
+				w->replay_done_seq = seg->seq;
+				break;
+			}
+			wal_path(w, seg->seq, path, sizeof(path));
+			unlink(path);
+			continue;
+		}
+
+		memcpy(dst + n * stride, payload, hdr->len < stride ? hdr->len : stride);
+		seg->off += WAL_REC_HDR + WAL_ALIGN(hdr->len);
+		n++;
+	}
+	return n;
+}
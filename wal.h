@@ -0,0 +1,133 @@
+/* 
+ * Copyright (c) 2013, Codefor <hk dot yuhe at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ -------------------------------------------------------------------------------
+ write-ahead log
+ -------------------------------------------------------------------------------
+ Every accepted event is appended to its worker's log before it is
+ queued, and acked by the worker once the sinks took it (or gave up).
+ A log is a list of segment files in wal_dir, named
+
+   wal-<worker>-<seq>.log
+
+ each mmap'd while it is live. A record is
+
+   uint32 len, uint32 sum (fnv-1a of payload), payload[len]   8-byte aligned
+
+ and its LSN is seq << 32 | offset, 0 is never an LSN. The sync thread
+ msync()s what was appended since its last run (group commit) and
+ removes the sealed segments whose records were all acked.
+ Segments left by a previous run are replayed once, at least once
+ delivery: what was acked but not removed yet is replayed again.
+*/
+
+#define WAL_LSN_SEQ(lsn)  ((lsn) >> 32)
+#define WAL_SEGMENT_MAX   ((uint64_t)1 << 32)  /* bytes, offsets fit an LSN */
+
+struct wal_segment {
+	uint64_t seq;
+	int      fd;
+	char    *base;
+	size_t   size;
+	size_t   off;          /* appended */
+	size_t   synced;       /* msync'd */
+	uint64_t outstanding;  /* records not acked */
+	int      sealed;
+};
+
+struct wal {
+	pthread_mutex_t lock;
+	pthread_mutex_t sync_lock;  /* one wal_sync() at a time */
+	int      closed;
+
+	char    *dir;
+	int      worker;
+	size_t   segment_bytes;
+
+	struct wal_segment *segs;  /* live segments, by seq, the last one is written */
+	int      nsegs;
+	int      cap;
+	uint64_t next_seq;
+
+	/* segments of a previous run, replayed by the worker */
+	uint64_t *replay_seqs;
+	int      nreplay;
+	int      replay_idx;
+	struct wal_segment replay;  /* base NULL if none is open */
+	int      replay_done;       /* a segment read to its end, removed by the next call */
+	uint64_t replay_done_seq;
+};
+
+/**
+ * open the log of a worker, segments of a previous run are kept for replay
+ * @return NULL on failure or segments above WAL_SEGMENT_MAX
+ */
+struct wal *wal_open(const char *dir, int worker, size_t segment_bytes);
+
+/* sync what is left, segments not fully acked are kept for the next run */
+void wal_close(struct wal *w);
+
+/**
+ * append a record, thread safe
+ * @return its LSN, 0 on failure
+ */
+uint64_t wal_append(struct wal *w, const void *rec, size_t len);
+
+/* ack n LSNs, 0s are ignored */
+void wal_ack(struct wal *w, const uint64_t *lsns, size_t n);
+
+/**
+ * group commit: msync the new records, then drop fully acked segments,
+ * called by the sync thread only
+ */
+void wal_sync(struct wal *w);
+
+/**
+ * read up to max records of the previous run, the i-th into
+ * recs + i * stride, single consumer only. A segment is removed by the
+ * call after the one that returned its last records, once they are sunk
+ * @return number of records read, 0 when the replay is done
+ */
+size_t wal_replay(struct wal *w, void *recs, size_t stride, size_t max);
+
+/* 1 while records of a previous run, or a segment to remove, are left */
+static inline int wal_replay_pending(struct wal *w)
+{
+	return w->replay_idx < w->nreplay || w->replay_done;
+}
+
+#endif